@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "io.h"
+
+#define AIO_FREE 0
+#define AIO_QUEUED 1
+#define AIO_INFLIGHT 2
+#define AIO_DONE 3
+
+#define AIO_STOP_TAG (~0ULL)
+
+typedef struct aio_slot {
+    unsigned ticket;
+    int write;
+    int state;
+    io_seg_t segs[IO_MAX_SEGS]; // one physically contiguous run
+    int num_of_segs;
+    size_t size;
+    struct iovec iov[IO_MAX_SEGS];
+    struct aio_slot* next;
+} aio_slot_t;
+
+static aio_slot_t aio_slots[AIO_QUEUE_DEPTH];
+static aio_slot_t* aio_queued[AIO_QUEUE_DEPTH];
+static int aio_queued_num = 0;
+static unsigned aio_next_ticket = 0;
+
+static int aio_engine = AIO_ENGINE_URING;
+static int aio_running = 0;
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* io_uring engine, driven through the raw syscalls so no liburing is needed */
+
+typedef struct aio_ring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned sq_entries;
+    pthread_t reaper;
+} aio_ring_t;
+
+static aio_ring_t ring = {.fd = -1};
+
+static int uring_setup(){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &p);
+    if(ring.fd < 0)
+        return 0;
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if(ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED){
+        close(ring.fd);
+        ring.fd = -1;
+        return 0;
+    }
+    ring.sq_head = (unsigned*)((char*)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned*)((char*)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)((char*)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)((char*)ring.sq_ptr + p.sq_off.array);
+    ring.cq_head = (unsigned*)((char*)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned*)((char*)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)((char*)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)((char*)ring.cq_ptr + p.cq_off.cqes);
+    ring.sq_entries = p.sq_entries;
+    return 1;
+}
+
+static void uring_teardown(){
+    munmap(ring.sqes, ring.sq_entries * sizeof(struct io_uring_sqe));
+    munmap(ring.cq_ptr, ring.cq_size);
+    munmap(ring.sq_ptr, ring.sq_size);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+static struct io_uring_sqe* uring_get_sqe(){
+    // at most AIO_QUEUE_DEPTH requests are ever outstanding, so the ring cannot be full
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    ring.sq_array[index] = index;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void uring_enter(unsigned to_submit){
+    while(to_submit > 0){
+        int ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, 0, 0, NULL, 0);
+        assert(ret > 0);
+        to_submit -= ret;
+    }
+}
+
+// already hold the aio_lock
+static void uring_submit(aio_slot_t** slots, int num){
+    for(int i = 0; i < num; i++){
+        aio_slot_t* slot = slots[i];
+        struct io_uring_sqe* sqe = uring_get_sqe();
+        sqe->opcode = slot->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = bios_sd_fd();
+        sqe->addr = (unsigned long)slot->iov;
+        sqe->len = slot->num_of_segs;
+        sqe->off = slot->segs[0].start_sector_id * 512;
+        sqe->user_data = slot->ticket;
+    }
+    uring_enter(num);
+}
+
+static void* uring_reaper(void* arg){
+    int running = 1;
+    while(running){
+        syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail)
+            continue;
+        for(; head != tail; head++){
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            if(cqe->user_data == AIO_STOP_TAG){
+                running = 0;
+                continue;
+            }
+            aio_slot_t* slot = &aio_slots[cqe->user_data % AIO_QUEUE_DEPTH];
+            if(cqe->res < 0 || cqe->res != slot->size){
+                // short or failed transfer, finish it the synchronous way
+                if(slot->write)
+                    bios_sd_writev(slot->segs, slot->num_of_segs);
+                else
+                    bios_sd_readv(slot->segs, slot->num_of_segs);
+            } else
+                io_account(slot->write, slot->size);
+            pthread_mutex_lock(&aio_lock);
+            slot->state = AIO_DONE;
+            pthread_mutex_unlock(&aio_lock);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&aio_done_cond);
+    }
+    return NULL;
+}
+
+static void uring_stop(){
+    pthread_mutex_lock(&aio_lock);
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = AIO_STOP_TAG;
+    uring_enter(1);
+    pthread_mutex_unlock(&aio_lock);
+    pthread_join(ring.reaper, NULL);
+}
+
+/* thread pool engine, works with every backend and on kernels without io_uring */
+
+static pthread_t aio_workers[AIO_MAX_THREAD_NUM];
+static int aio_thread_num = AIO_THREAD_NUM;
+static pthread_cond_t aio_work_cond = PTHREAD_COND_INITIALIZER;
+static aio_slot_t *aio_work_head = NULL, *aio_work_tail = NULL;
+static int aio_workers_stop = 0;
+
+static void* aio_worker(void* arg){
+    pthread_mutex_lock(&aio_lock);
+    while(1){
+        while(aio_work_head == NULL && !aio_workers_stop)
+            pthread_cond_wait(&aio_work_cond, &aio_lock);
+        if(aio_work_head == NULL)
+            break;
+        aio_slot_t* slot = aio_work_head;
+        aio_work_head = slot->next;
+        if(aio_work_head == NULL)
+            aio_work_tail = NULL;
+        pthread_mutex_unlock(&aio_lock);
+
+        if(slot->write)
+            bios_sd_writev(slot->segs, slot->num_of_segs);
+        else
+            bios_sd_readv(slot->segs, slot->num_of_segs);
+
+        pthread_mutex_lock(&aio_lock);
+        slot->state = AIO_DONE;
+        pthread_cond_broadcast(&aio_done_cond);
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return NULL;
+}
+
+// already hold the aio_lock
+static void threads_submit(aio_slot_t** slots, int num){
+    for(int i = 0; i < num; i++){
+        slots[i]->next = NULL;
+        if(aio_work_tail == NULL)
+            aio_work_head = slots[i];
+        else
+            aio_work_tail->next = slots[i];
+        aio_work_tail = slots[i];
+    }
+    pthread_cond_broadcast(&aio_work_cond);
+}
+
+static void threads_stop(){
+    pthread_mutex_lock(&aio_lock);
+    aio_workers_stop = 1;
+    pthread_cond_broadcast(&aio_work_cond);
+    pthread_mutex_unlock(&aio_lock);
+    for(int i = 0; i < aio_thread_num; i++)
+        pthread_join(aio_workers[i], NULL);
+    aio_workers_stop = 0;
+}
+
+/* engine independent queueing */
+
+// already hold the aio_lock
+static void aio_submit_locked(){
+    if(aio_queued_num == 0)
+        return;
+    for(int i = 0; i < aio_queued_num; i++)
+        aio_queued[i]->state = AIO_INFLIGHT;
+    if(aio_engine == AIO_ENGINE_URING)
+        uring_submit(aio_queued, aio_queued_num);
+    else
+        threads_submit(aio_queued, aio_queued_num);
+    aio_queued_num = 0;
+}
+
+// already hold the aio_lock
+static void aio_wait_locked(unsigned ticket){
+    aio_slot_t* slot = &aio_slots[ticket % AIO_QUEUE_DEPTH];
+    if(slot->ticket != ticket)
+        return;
+    if(slot->state == AIO_QUEUED)
+        aio_submit_locked();
+    while(slot->state == AIO_INFLIGHT)
+        pthread_cond_wait(&aio_done_cond, &aio_lock);
+}
+
+// segs must be one physically contiguous run of at most IO_MAX_SEGS segments
+static unsigned aio_queue(int write, io_seg_t* segs, int num_of_segs){
+    assert(aio_running);
+    assert(num_of_segs > 0 && num_of_segs <= IO_MAX_SEGS);
+    pthread_mutex_lock(&aio_lock);
+    unsigned ticket = aio_next_ticket++;
+    aio_slot_t* slot = &aio_slots[ticket % AIO_QUEUE_DEPTH];
+    // the slot is recycled once the request that used it has completed
+    if(slot->state != AIO_FREE)
+        aio_wait_locked(slot->ticket);
+    slot->ticket = ticket;
+    slot->write = write;
+    slot->state = AIO_QUEUED;
+    slot->num_of_segs = num_of_segs;
+    slot->size = 0;
+    for(int i = 0; i < num_of_segs; i++){
+        slot->segs[i] = segs[i];
+        slot->iov[i].iov_base = (void*)segs[i].buf_addr;
+        slot->iov[i].iov_len = (size_t)segs[i].num_of_sectors * 512;
+        slot->size += slot->iov[i].iov_len;
+    }
+    aio_queued[aio_queued_num++] = slot;
+    pthread_mutex_unlock(&aio_lock);
+    return ticket;
+}
+
+unsigned aio_read(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id){
+    io_seg_t seg = {buf_addr, num_of_sectors, start_sector_id};
+    return aio_queue(0, &seg, 1);
+}
+
+unsigned aio_write(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id){
+    io_seg_t seg = {buf_addr, num_of_sectors, start_sector_id};
+    return aio_queue(1, &seg, 1);
+}
+
+static unsigned aio_queue_vector(int write, io_seg_t* segs, int num_of_segs){
+    unsigned ticket = 0;
+    while(num_of_segs > 0){
+        int run = bios_sd_run_len(segs, num_of_segs);
+        ticket = aio_queue(write, segs, run);
+        segs += run;
+        num_of_segs -= run;
+    }
+    return ticket;
+}
+
+unsigned aio_readv(io_seg_t* segs, int num_of_segs){
+    return aio_queue_vector(0, segs, num_of_segs);
+}
+
+unsigned aio_writev(io_seg_t* segs, int num_of_segs){
+    return aio_queue_vector(1, segs, num_of_segs);
+}
+
+void aio_submit(){
+    pthread_mutex_lock(&aio_lock);
+    aio_submit_locked();
+    pthread_mutex_unlock(&aio_lock);
+}
+
+void aio_wait(unsigned ticket){
+    pthread_mutex_lock(&aio_lock);
+    aio_wait_locked(ticket);
+    pthread_mutex_unlock(&aio_lock);
+}
+
+void aio_wait_all(){
+    pthread_mutex_lock(&aio_lock);
+    aio_submit_locked();
+    for(int i = 0; i < AIO_QUEUE_DEPTH; i++)
+        while(aio_slots[i].state == AIO_INFLIGHT)
+            pthread_cond_wait(&aio_done_cond, &aio_lock);
+    pthread_mutex_unlock(&aio_lock);
+}
+
+void change_aio_engine(int engine){
+    assert(engine == AIO_ENGINE_URING || engine == AIO_ENGINE_THREADS);
+    aio_engine = engine;
+}
+
+int get_aio_engine(){
+    return aio_engine;
+}
+
+void init_aio(){
+    for(int i = 0; i < AIO_QUEUE_DEPTH; i++)
+        aio_slots[i].state = AIO_FREE;
+    // io_uring needs a plain fd, stdio and mmap go through the thread pool
+    if(aio_engine == AIO_ENGINE_URING && (bios_sd_fd() < 0 || !uring_setup()))
+        aio_engine = AIO_ENGINE_THREADS;
+    // an emulated device is charged in bios_sd_*, which io_uring would bypass
+    int queue_depth = get_io_throttle_queue_depth();
+    if(queue_depth > 0){
+        if(aio_engine == AIO_ENGINE_URING)
+            uring_teardown();
+        aio_engine = AIO_ENGINE_THREADS;
+        aio_thread_num = queue_depth < AIO_THREAD_NUM ? AIO_THREAD_NUM : queue_depth;
+        if(aio_thread_num > AIO_MAX_THREAD_NUM)
+            aio_thread_num = AIO_MAX_THREAD_NUM;
+    }
+    if(aio_engine == AIO_ENGINE_URING)
+        pthread_create(&ring.reaper, NULL, uring_reaper, NULL);
+    else
+        for(int i = 0; i < aio_thread_num; i++)
+            pthread_create(&aio_workers[i], NULL, aio_worker, NULL);
+    aio_running = 1;
+}
+
+void release_aio(){
+    if(!aio_running)
+        return;
+    aio_wait_all();
+    if(aio_engine == AIO_ENGINE_URING){
+        uring_stop();
+        uring_teardown();
+    } else
+        threads_stop();
+    aio_running = 0;
+}
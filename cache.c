@@ -1,176 +1,1182 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "cache.h"
 #include "type.h"
 #include "vm.h"
 #include "io.h"
 
-cache_block_t cache_block[TOTAL_MAX_CACHE_SIZE / CACHE_BLOCK_SIZE];
-cache_line_t cache_line[LINE_NUM];
+// block data followed by the metadata arrays, one mapping sized at fs_cache_init
+static void* cache_arena = NULL;
+static size_t cache_arena_size = 0;
+static int cache_arena_type = CACHE_ARENA_PAGES;
+static uint64_t cache_size = CACHE_DEFAULT_SIZE;
 
-int remain_free_block = TOTAL_MAX_CACHE_SIZE / CACHE_BLOCK_SIZE;
+int cache_block_num = 0;
+cache_block_t* cache_block = NULL;
 
-// 0:write-back, 1:write-through
-int page_cache_policy = 0;
+// ARC remembers the numbers of recently evicted blocks, at most one ghost per cache block
+static cache_block_t* cache_ghost = NULL;
+
+static cache_shard_t cache_shards[CACHE_SHARDS];
+
+static cache_stream_t cache_streams[CACHE_RA_STREAMS];
+static unsigned stream_clock = 0;
+// protects the streams, never taken while holding a shard lock
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one writeback at a time, so two writes of the same block are never in flight together,
+// taken before a shard lock
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_block_t** flush_blocks = NULL;
+// updated under flush_lock, read without it
+static uint64_t flush_rounds = 0, flush_ns = 0, flush_max_ns = 0;
+
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_running = 0;
+static void flusher_start();
+// set by the file system, see change_cache_flush_hook
+static void (*flush_hook)(int all) = NULL;
+
+static int warmup_enabled = 1;
+static pthread_t warmer;
+static int warmer_running = 0;
+static int warmer_stop = 0;
+static void warmer_start();
+static void cache_warm_save();
+
+// CACHE_WRITE_* | CACHE_REPLACE_*
+int page_cache_policy = CACHE_WRITE_BACK | CACHE_REPLACE_LRU;
 
 // seconds for write-back to flush cache
 int write_back_freq = 30;
 
+static size_t cache_align(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+// reserve size bytes, from the huge page pool if the system has one, else aligned for THP
+static int cache_arena_map(size_t size) {
+    size = cache_align(size, CACHE_HUGEPAGE_SIZE);
+    void* arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(arena != MAP_FAILED) {
+        cache_arena_type = CACHE_ARENA_HUGETLB;
+    } else {
+        // over-reserve and trim, only huge page aligned ranges can be backed by huge pages
+        size_t reserve = size + CACHE_HUGEPAGE_SIZE;
+        char* p = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED)
+            return 0;
+        char* begin = (char*)cache_align((unsigned long)p, CACHE_HUGEPAGE_SIZE);
+        if(begin > p)
+            munmap(p, begin - p);
+        if(begin + size < p + reserve)
+            munmap(begin + size, p + reserve - (begin + size));
+        arena = begin;
+        cache_arena_type = madvise(arena, size, MADV_HUGEPAGE) == 0 ? CACHE_ARENA_THP : CACHE_ARENA_PAGES;
+    }
+    cache_arena = arena;
+    cache_arena_size = size;
+    return 1;
+}
+
+// carve the block data and the metadata arrays out of the arena, and split them over the shards
+static int cache_arena_init() {
+    int capacity = cache_size / CACHE_BLOCK_SIZE / CACHE_SHARDS;
+    cache_block_num = capacity * CACHE_SHARDS;
+    uint32_t hash_size = 1;
+    while(hash_size < (uint32_t)CACHE_HASH_FACTOR * capacity)
+        hash_size <<= 1;
+    // the mmap backend points cache blocks into the image mapping, they need no data of their own
+    size_t data_size = bios_sd_map(0) != NULL ? 0 : (size_t)cache_block_num * CACHE_BLOCK_SIZE;
+    size_t meta_size = 2 * cache_block_num * sizeof(cache_block_t)
+        + cache_block_num * sizeof(cache_block_t*) + CACHE_SHARDS * hash_size * sizeof(int);
+    if(!cache_arena_map(data_size + meta_size))
+        return 0;
+    char* p = (char*)cache_arena + data_size;
+    cache_block = (cache_block_t*)p;
+    p += cache_block_num * sizeof(cache_block_t);
+    cache_ghost = (cache_block_t*)p;
+    p += cache_block_num * sizeof(cache_block_t);
+    flush_blocks = (cache_block_t**)p;
+    p += cache_block_num * sizeof(cache_block_t*);
+    for(int i = 0; i < cache_block_num; i++)
+        cache_block[i].data = data_size == 0 ? NULL : (block_t*)cache_arena + i;
+    for(int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache_shards[i];
+        shard->blocks = cache_block + i * capacity;
+        shard->ghosts = cache_ghost + i * capacity;
+        shard->capacity = capacity;
+        shard->hash = (int*)p + i * hash_size;
+        shard->hash_mask = hash_size - 1;
+    }
+    return 1;
+}
+
 int fs_cache_init() {
-    int i;
-    for (i = 0; i < LINE_NUM; i++) {
-        cache_line[i].head = cache_line[i].tail = NULL;
-        cache_line[i].size = 0;
+    int i, j;
+    if(!cache_arena_init()) {
+        printf("cache: cannot reserve %lu MB\n", cache_size >> 20);
+        exit(1);
     }
-    for (i = 0; i < TOTAL_MAX_CACHE_SIZE / CACHE_BLOCK_SIZE; i++) {
+    for (i = 0; i < cache_block_num; i++) {
         cache_block[i].valid = 0;
         cache_block[i].dirty = 0;
-        cache_block[i].data = NULL;
-        cache_block[i].next = NULL;
+        cache_block[i].writeback = 0;
+        cache_block[i].readahead = 0;
+        cache_block[i].prefetched = 0;
+        cache_block[i].reading = 0;
+        cache_block[i].spill = 0;
+        cache_block[i].refcnt = 0;
+        cache_block[i].prev = cache_block[i].next = NULL;
+    }
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache_shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->cond, NULL);
+        for (j = 0; j <= (int)shard->hash_mask; j++)
+            shard->hash[j] = CACHE_HASH_EMPTY;
+        shard->ghost_free = NULL;
+        for (j = 0; j < shard->capacity; j++) {
+            shard->ghosts[j].valid = 0;
+            shard->ghosts[j].dirty = 0;
+            shard->ghosts[j].data = NULL;
+            shard->ghosts[j].prev = NULL;
+            shard->ghosts[j].next = shard->ghost_free;
+            shard->ghost_free = &shard->ghosts[j];
+        }
+        for (j = 0; j < CACHE_LIST_NUM; j++) {
+            shard->lists[j].head = shard->lists[j].tail = NULL;
+            shard->lists[j].size = 0;
+        }
+        shard->arc_p = 0;
+        shard->remain_free = shard->capacity;
+        shard->dirty_num = 0;
+        shard->spill_num = 0;
     }
+    for (i = 0; i < CACHE_RA_STREAMS; i++) {
+        cache_streams[i].next_block = cache_streams[i].ra_end = 0;
+        cache_streams[i].window = 0;
+        cache_streams[i].last_use = 0;
+    }
+    cache_reset_stat();
+    // the mapping backend keeps evicted blocks in the page cache already
+    if(bios_sd_map(0) == NULL)
+        ztier_init();
+    flusher_start();
+    warmer_start();
     return 0;
 }
 
-static cache_block_t* cache_block_alloc() {
-    if(remain_free_block == 0)
+static uint64_t cache_hash_key(uint64_t block_id) {
+    // fibonacci hashing spreads the sequential block numbers of a file over the shards and tables
+    return block_id * 0x9E3779B97F4A7C15ULL;
+}
+
+static cache_shard_t* cache_shard_of(uint64_t block_id) {
+    return &cache_shards[cache_hash_key(block_id) >> (64 - CACHE_SHARD_BITS)];
+}
+
+// already hold the shard lock
+static cache_block_t* cache_block_alloc(cache_shard_t* shard) {
+    if(shard->remain_free == 0)
         return NULL;
-    cache_block_t* block = &cache_block[--remain_free_block];
+    cache_block_t* block = &shard->blocks[--shard->remain_free];
     block->valid = 1;
     block->dirty = 0;
-    block->data = (block_t*)allocPage();
-    block->next = NULL;
+    block->refcnt = 0;
+    block->spill = 0;
+    block->prev = block->next = NULL;
     return block;
 }
 
-static cache_line_t* cache_find_maxline() {
-    int maxsize = cache_line[0].size;
-    cache_line_t* maxline = &cache_line[0];
-    for(int i = 1; i < LINE_NUM; i++) {
-        if(cache_line[i].size > maxsize) {
-            maxsize = cache_line[i].size;
-            maxline = &cache_line[i];
+static cache_block_t* cache_entry(int index) {
+    return index < cache_block_num ? &cache_block[index] : &cache_ghost[index - cache_block_num];
+}
+
+static int cache_entry_index(cache_block_t* entry) {
+    if(entry >= cache_block && entry < cache_block + cache_block_num)
+        return entry - cache_block;
+    return cache_block_num + (entry - cache_ghost);
+}
+
+static uint32_t cache_hash_home(cache_shard_t* shard, uint64_t block_id) {
+    // the top bits picked the shard, the slot comes from the bits below them
+    return (uint32_t)(cache_hash_key(block_id) >> 32) & shard->hash_mask;
+}
+
+static int cache_hash_find(cache_shard_t* shard, uint64_t block_id) {
+    for(uint32_t i = cache_hash_home(shard, block_id); ; i = (i + 1) & shard->hash_mask) {
+        int index = shard->hash[i];
+        if(index == CACHE_HASH_EMPTY || cache_entry(index)->block_id == block_id)
+            return i;
+    }
+}
+
+static void cache_hash_insert(cache_shard_t* shard, cache_block_t* entry) {
+    int i = cache_hash_find(shard, entry->block_id);
+    assert(shard->hash[i] == CACHE_HASH_EMPTY);
+    shard->hash[i] = cache_entry_index(entry);
+}
+
+static void cache_hash_remove(cache_shard_t* shard, cache_block_t* entry) {
+    uint32_t mask = shard->hash_mask;
+    uint32_t hole = cache_hash_find(shard, entry->block_id);
+    assert(shard->hash[hole] == cache_entry_index(entry));
+    // backward shift deletion: pull later entries of the probe run into the hole
+    for(uint32_t i = (hole + 1) & mask; shard->hash[i] != CACHE_HASH_EMPTY; i = (i + 1) & mask) {
+        uint32_t home = cache_hash_home(shard, cache_entry(shard->hash[i])->block_id);
+        // an entry may move only if its home is not cyclically inside (hole, i]
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            shard->hash[hole] = shard->hash[i];
+            hole = i;
+        }
+    }
+    shard->hash[hole] = CACHE_HASH_EMPTY;
+}
+
+static void cache_list_add(cache_shard_t* shard, cache_block_t* entry, int list) {
+    cache_list_t* l = &shard->lists[list];
+    entry->list = list;
+    entry->prev = NULL;
+    entry->next = l->head;
+    if(l->head != NULL)
+        l->head->prev = entry;
+    l->head = entry;
+    if(l->tail == NULL)
+        l->tail = entry;
+    l->size++;
+}
+
+static void cache_list_remove(cache_shard_t* shard, cache_block_t* entry) {
+    cache_list_t* l = &shard->lists[entry->list];
+    if(entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        l->head = entry->next;
+    if(entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        l->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    l->size--;
+}
+
+static void cache_list_move(cache_shard_t* shard, cache_block_t* entry, int list) {
+    if(entry->list == list && shard->lists[list].head == entry)
+        return;
+    cache_list_remove(shard, entry);
+    cache_list_add(shard, entry, list);
+}
+
+static int cache_pinned(cache_block_t* block) {
+    // a block still being filled belongs to whoever fills it
+    return block->refcnt > 0 || block->reading;
+}
+
+static int cache_evictable(cache_shard_t* shard, int list) {
+    // only a few blocks are pinned at a time, and they were touched recently
+    for(cache_block_t* block = shard->lists[list].tail; block != NULL; block = block->prev)
+        if(!cache_pinned(block))
+            return 1;
+    return 0;
+}
+
+// already hold the shard lock
+// the dirty sectors of block as runs of adjacent sectors, returns the number of runs
+static int cache_dirty_segs(cache_shard_t* shard, cache_block_t* block, io_seg_t* segs) {
+    uint8_t dirty = block->dirty;
+    // O_DIRECT moves whole aligned blocks, a partial write would cost a read-modify-write
+    if(get_io_backend() == IO_BACKEND_DIRECT)
+        dirty = CACHE_DIRTY_ALL;
+    int num = 0;
+    for(int i = 0; i < CACHE_BLOCK_SECTOR; ) {
+        if(!(dirty & (1 << i))) {
+            i++;
+            continue;
         }
+        int j = i + 1;
+        while(j < CACHE_BLOCK_SECTOR && (dirty & (1 << j)))
+            j++;
+        segs[num].buf_addr = KVA2PA((sector_t*)block->data + i);
+        segs[num].num_of_sectors = j - i;
+        segs[num].start_sector_id = GET_SECTOR(block->block_id) + i;
+        shard->stat.writeback_sectors += j - i;
+        num++;
+        i = j;
     }
-    return maxline;
+    shard->stat.writebacks++;
+    return num;
 }
 
-static void cache_line_add(cache_block_t* block, uint32_t index) {
-    block->next = cache_line[index].head;
-    cache_line[index].head = block;
-    if(cache_line[index].tail == NULL) {
-        cache_line[index].tail = block;
+// already hold the shard lock
+static void cache_flush_block(cache_shard_t* shard, cache_block_t* block) {
+    if(block->dirty) {
+        io_seg_t segs[CACHE_BLOCK_SECTOR];
+        bios_sd_writev(segs, cache_dirty_segs(shard, block, segs));
+        block->dirty = 0;
+        shard->dirty_num--;
     }
-    cache_line[index].size++;
 }
 
-static void cache_line_remove(cache_block_t* block, uint32_t index) {
-    cache_block_t* p = NULL;
-    if(cache_line[index].head == block) {
-        cache_line[index].head = block->next;
-    } else {
-        p = cache_line[index].head;
-        while(p->next!= block) {
-            p = p->next;
+static void ghost_release(cache_shard_t* shard, cache_block_t* ghost) {
+    cache_list_remove(shard, ghost);
+    cache_hash_remove(shard, ghost);
+    ghost->next = shard->ghost_free;
+    shard->ghost_free = ghost;
+}
+
+static void ghost_add(cache_shard_t* shard, uint64_t block_id, int list) {
+    if(shard->ghost_free == NULL)
+        ghost_release(shard, shard->lists[CACHE_B1].size > 0 ? shard->lists[CACHE_B1].tail : shard->lists[CACHE_B2].tail);
+    cache_block_t* ghost = shard->ghost_free;
+    shard->ghost_free = ghost->next;
+    ghost->block_id = block_id;
+    cache_hash_insert(shard, ghost);
+    cache_list_add(shard, ghost, list);
+}
+
+static void flusher_wakeup() {
+    pthread_mutex_lock(&flusher_lock);
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+}
+
+// already hold the shard lock, dropped while the block is written
+// write a dirty victim back in place, it is evicted clean on the next try
+static void cache_evict_writeback(cache_shard_t* shard, cache_block_t* block) {
+    block->refcnt++;
+    pthread_mutex_unlock(&shard->lock);
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&shard->lock);
+    io_seg_t segs[CACHE_BLOCK_SECTOR];
+    int num_of_segs = 0;
+    // the flusher may have been faster
+    if(block->dirty) {
+        num_of_segs = cache_dirty_segs(shard, block, segs);
+        block->dirty = 0;
+        block->writeback = 1;
+        shard->dirty_num--;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if(num_of_segs > 0)
+        bios_sd_writev(segs, num_of_segs);
+    pthread_mutex_lock(&shard->lock);
+    block->writeback = 0;
+    block->refcnt--;
+    pthread_cond_broadcast(&shard->cond);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+// already hold the shard lock
+// unlink a cold block of list, leaving a ghost on ghost_list if >= 0.
+// NULL if there was no clean block: unless nowait, a dirty or read ahead victim has been dealt
+// with meanwhile, outside the shard lock, and the caller looks its block up again
+static cache_block_t* cache_evict(cache_shard_t* shard, int list, int ghost_list, int nowait) {
+    cache_block_t* block;
+    if(nowait && !cache_evictable(shard, list))
+        return NULL;
+    // every block of the list pinned means more references are held than the cache has blocks
+    assert(cache_evictable(shard, list));
+    // a clean block near the cold end costs no I/O, dirty ones are left to the flusher
+    cache_block_t *dirty = NULL, *reading = NULL;
+    int scan = 0;
+    for(block = shard->lists[list].tail; block != NULL; block = block->prev) {
+        // pinned blocks do not use up the scan
+        if(cache_pinned(block))
+            continue;
+        if(scan++ == CACHE_EVICT_SCAN) {
+            block = NULL;
+            break;
+        }
+        if(block->writeback)
+            continue;
+        if(block->readahead) {
+            if(reading == NULL)
+                reading = block;
+            continue;
         }
-        p->next = block->next;
+        if(!block->dirty)
+            break;
+        if(dirty == NULL)
+            dirty = block;
     }
-    if(cache_line[index].tail == block) {
-        cache_line[index].tail = p;
+    if(block == NULL) {
+        flusher_wakeup();
+        if(nowait)
+            return NULL;
+        if(dirty != NULL) {
+            cache_evict_writeback(shard, dirty);
+        } else if(reading != NULL) {
+            // read ahead and never used, evictable once the transfer is done
+            unsigned ticket = reading->ticket;
+            reading->refcnt++;
+            pthread_mutex_unlock(&shard->lock);
+            aio_wait(ticket);
+            pthread_mutex_lock(&shard->lock);
+            reading->readahead = 0;
+            reading->refcnt--;
+        } else {
+            // everything cold is being written back right now
+            pthread_cond_wait(&shard->cond, &shard->lock);
+        }
+        return NULL;
+    }
+    cache_list_remove(shard, block);
+    cache_hash_remove(shard, block);
+    // clean, so the copy is as good as the device. It is compressed by the caller once the shard
+    // lock is dropped (see cache_spill), in place only if too many are on the way already
+    block->spill = 0;
+    if(block->data != NULL && ztier_enabled()) {
+        if(shard->spill_num < CACHE_SPILL_MAX) {
+            shard->spills[shard->spill_num++] = block->block_id;
+            block->spill = 1;
+            block->spill_id = block->block_id;
+        } else {
+            ztier_store(block->block_id, block->data);
+        }
     }
-    block->next = NULL;
-    cache_line[index].size--;
+    block->prefetched = 0;
+    shard->stat.evictions++;
+    if(ghost_list >= 0)
+        ghost_add(shard, block->block_id, ghost_list);
+    return block;
+}
+
+// already hold the shard lock
+// block_id was evicted and its copy is not in the compressed tier yet
+static int cache_spilling(cache_shard_t* shard, uint64_t block_id) {
+    for(int i = 0; i < shard->spill_num; i++)
+        if(shard->spills[i] == block_id)
+            return 1;
+    return 0;
 }
 
-static void cache_line_float(cache_block_t* block, uint32_t index) {
-    cache_line_remove(block, index);
-    cache_line_add(block, index);
+// store the block a frame held before cache_evict into the compressed tier, without the shard
+// lock. The frame is marked reading meanwhile, so nobody else touches its data
+static void cache_spill(cache_block_t* block) {
+    if(block->spill)
+        ztier_store(block->spill_id, block->data);
 }
 
-static cache_block_t* map_cache(uint32_t sector_id) {
-    uint32_t index = GET_INDEX(sector_id);
-    uint32_t tag = GET_TAG(sector_id);
-    for(cache_block_t* p = cache_line[index].head; p != NULL; p = p->next) {
-        if(p->tag == tag) {
-            cache_line_float(p, index);
-            return p;
+// already hold the shard lock
+// let the misses of the block stored by cache_spill go on, the caller broadcasts the shard cond
+static void cache_spill_done(cache_shard_t* shard, cache_block_t* block) {
+    if(!block->spill)
+        return;
+    block->spill = 0;
+    for(int i = 0; i < shard->spill_num; i++) {
+        if(shard->spills[i] == block->spill_id) {
+            shard->spills[i] = shard->spills[--shard->spill_num];
+            break;
         }
     }
-    return NULL;
 }
 
-static cache_block_t* cache_lru_replace() {
-    cache_line_t* maxline = cache_find_maxline();
-    int index = maxline - cache_line;
-    cache_block_t* block = maxline->tail;
-    if(GET_SECTOR(block->tag, index) == (SUPERBLOCK_BEGIN_SECTOR & ~OFFSET_MASK)) {
-        cache_line_float(block, index);
-        block = maxline->tail;
+// ARC REPLACE: free a frame from T1 or T2 depending on the target size arc_p
+static cache_block_t* arc_frame(cache_shard_t* shard, int arc_p, int hit_b2, int nowait) {
+    if(shard->remain_free > 0)
+        return cache_block_alloc(shard);
+    int t1 = shard->lists[CACHE_T1].size;
+    if((t1 > arc_p || (hit_b2 && t1 == arc_p)) && cache_evictable(shard, CACHE_T1))
+        return cache_evict(shard, CACHE_T1, CACHE_B1, nowait);
+    if(cache_evictable(shard, CACHE_T2))
+        return cache_evict(shard, CACHE_T2, CACHE_B2, nowait);
+    return cache_evict(shard, CACHE_T1, CACHE_B1, nowait);
+}
+
+// nothing changes until there is a frame: a NULL frame drops the shard lock and the caller
+// retries, which must see the ghost hit and the directory as they were
+static cache_block_t* arc_miss(cache_shard_t* shard, uint64_t block_id, int* list, int nowait) {
+    int c = shard->capacity;
+    int t1 = shard->lists[CACHE_T1].size;
+    int b1 = shard->lists[CACHE_B1].size, b2 = shard->lists[CACHE_B2].size;
+    int index = shard->hash[cache_hash_find(shard, block_id)];
+    cache_block_t* block;
+    if(index != CACHE_HASH_EMPTY) {
+        // a ghost hit means the list it was evicted from deserves more room
+        int hit_b2 = cache_entry(index)->list == CACHE_B2;
+        int arc_p = shard->arc_p;
+        if(hit_b2)
+            arc_p -= b1 > b2 ? b1 / b2 : 1;
+        else
+            arc_p += b2 > b1 ? b2 / b1 : 1;
+        arc_p = arc_p < 0 ? 0 : (arc_p > c ? c : arc_p);
+        block = arc_frame(shard, arc_p, hit_b2, nowait);
+        if(block == NULL)
+            return NULL;
+        shard->arc_p = arc_p;
+        // the eviction may have recycled the ghost already
+        index = shard->hash[cache_hash_find(shard, block_id)];
+        if(index != CACHE_HASH_EMPTY)
+            ghost_release(shard, cache_entry(index));
+        *list = CACHE_T2;
+        return block;
     }
-    cache_line_remove(block, index);
-    if(block->dirty) {
-        bios_sd_write(KVA2PA(block->data), 8, GET_SECTOR(block->tag, index));
-        block->dirty = 0;
+    *list = CACHE_T1;
+    if(t1 + b1 >= c && b1 == 0)
+        return shard->remain_free > 0 ? cache_block_alloc(shard) : cache_evict(shard, CACHE_T1, -1, nowait);
+    block = arc_frame(shard, shard->arc_p, 0, nowait);
+    if(block == NULL)
+        return NULL;
+    // room for the new block in T1 + B1 (at most c) and in the whole directory (at most 2c),
+    // unless the ghost left by the eviction has made it already
+    t1 = shard->lists[CACHE_T1].size;
+    int t2 = shard->lists[CACHE_T2].size;
+    b1 = shard->lists[CACHE_B1].size;
+    b2 = shard->lists[CACHE_B2].size;
+    if(t1 + b1 >= c && b1 > 0)
+        ghost_release(shard, shard->lists[CACHE_B1].tail);
+    else if(t1 + t2 + b1 + b2 >= 2 * c && b2 > 0)
+        ghost_release(shard, shard->lists[CACHE_B2].tail);
+    return block;
+}
+
+// already hold the shard lock
+static cache_block_t* map_cache(cache_shard_t* shard, uint64_t block_id) {
+    int index = shard->hash[cache_hash_find(shard, block_id)];
+    if(index == CACHE_HASH_EMPTY || index >= cache_block_num)
+        return NULL;
+    return &cache_block[index];
+}
+
+static int cache_is_meta(uint64_t sector_id) {
+    if(now_superblock == NULL || sector_id < now_superblock->block_table_begin_sector)
+        return 1;
+    // the bitmaps and the inode table at the head of every group
+    return (sector_id - now_superblock->block_table_begin_sector) % GROUP_SECTORS < GROUP_META_BLOCKS * SECTOR_IN_BLOCK;
+}
+
+static uint32_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// already hold the shard lock
+// a frame for block_id, NULL if the shard lock was dropped on the way (see cache_evict)
+static cache_block_t* cache_frame(cache_shard_t* shard, uint64_t block_id, int* list, int nowait) {
+    *list = CACHE_T1;
+    if(page_cache_policy & CACHE_REPLACE_ARC)
+        return arc_miss(shard, block_id, list, nowait);
+    if(shard->remain_free > 0)
+        return cache_block_alloc(shard);
+    return cache_evict(shard, CACHE_T1, -1, nowait);
+}
+
+// hand the ticket of a queued run to its blocks, which can be waited for from now on
+static void cache_readahead_run(io_seg_t* segs, cache_block_t** run, int num) {
+    if(num == 0)
+        return;
+    unsigned ticket = aio_readv(segs, num);
+    for(int i = 0; i < num; i++) {
+        cache_shard_t* shard = cache_shard_of(run[i]->block_id);
+        pthread_mutex_lock(&shard->lock);
+        run[i]->ticket = ticket;
+        run[i]->reading = 0;
+        pthread_cond_broadcast(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// start reading b into the cache unless it is cached already, adding it to the run in segs,
+// which is queued first if b does not continue it. Returns 0 if a frame would cost a writeback
+static int cache_prefetch(uint64_t b, io_seg_t* segs, cache_block_t** run, int* num) {
+    cache_shard_t* shard = cache_shard_of(b);
+    pthread_mutex_lock(&shard->lock);
+    if(map_cache(shard, b) != NULL || cache_spilling(shard, b)) {
+        pthread_mutex_unlock(&shard->lock);
+        return 1;
+    }
+    int list;
+    cache_block_t* block = cache_frame(shard, b, &list, 1);
+    if(block == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    block->block_id = b;
+    block->readahead = 1;
+    block->prefetched = 1;
+    // no ticket to wait for until the run is queued
+    block->reading = 1;
+    cache_hash_insert(shard, block);
+    cache_list_add(shard, block, list);
+    shard->stat.readaheads++;
+    pthread_mutex_unlock(&shard->lock);
+    cache_spill(block);
+    int hit = ztier_load(b, block->data);
+    if(hit || block->spill) {
+        pthread_mutex_lock(&shard->lock);
+        cache_spill_done(shard, block);
+        if(hit) {
+            block->readahead = 0;
+            block->reading = 0;
+        }
+        pthread_cond_broadcast(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+        if(hit)
+            return 1;
+    }
+    // one ticket covers a run only if it is contiguous on disk
+    if(*num == IO_MAX_SEGS || (*num > 0 && segs[*num - 1].start_sector_id + CACHE_BLOCK_SECTOR != GET_SECTOR(b))) {
+        cache_readahead_run(segs, run, *num);
+        *num = 0;
+    }
+    segs[*num].buf_addr = KVA2PA(block->data);
+    segs[*num].num_of_sectors = CACHE_BLOCK_SECTOR;
+    segs[*num].start_sector_id = GET_SECTOR(b);
+    run[(*num)++] = block;
+    return 1;
+}
+
+// fetch the blocks in [begin, end) that are not cached yet without waiting for them,
+// stopping where a frame would cost a writeback
+static void cache_readahead(uint64_t begin, uint64_t end) {
+    uint64_t max_block = GET_BLOCK(bios_sd_sectors());
+    if(end > max_block)
+        end = max_block;
+    io_seg_t segs[IO_MAX_SEGS];
+    cache_block_t* run[IO_MAX_SEGS];
+    int num = 0;
+    for(uint64_t b = begin; b < end; b++)
+        if(!cache_prefetch(b, segs, run, &num))
+            break;
+    cache_readahead_run(segs, run, num);
+    aio_submit();
+}
+
+// follow the sequential streams, reading ahead once a reader gets within half a window of the end
+static void cache_stream_access(uint64_t block_id) {
+    cache_stream_t* stream = NULL;
+    uint64_t begin = 0, end = 0;
+    pthread_mutex_lock(&stream_lock);
+    cache_stream_t* oldest = &cache_streams[0];
+    stream_clock++;
+    for(int i = 0; i < CACHE_RA_STREAMS; i++) {
+        cache_stream_t* s = &cache_streams[i];
+        if(oldest->window != 0 && (s->window == 0 || s->last_use < oldest->last_use))
+            oldest = s;
+        if(s->window == 0)
+            continue;
+        // the other sectors of the block just touched
+        if(block_id + 1 == s->next_block) {
+            pthread_mutex_unlock(&stream_lock);
+            return;
+        }
+        // sequential, possibly skipping a few blocks such as an indirect block
+        if(block_id >= s->next_block && block_id < (s->ra_end > s->next_block ? s->ra_end : s->next_block + 1)) {
+            stream = s;
+            break;
+        }
+    }
+    if(stream == NULL) {
+        oldest->next_block = oldest->ra_end = block_id + 1;
+        oldest->window = CACHE_RA_MIN_WINDOW;
+        oldest->last_use = stream_clock;
+    } else {
+        stream->next_block = block_id + 1;
+        stream->last_use = stream_clock;
+        if(block_id + stream->window / 2 >= stream->ra_end) {
+            begin = stream->ra_end > block_id + 1 ? stream->ra_end : block_id + 1;
+            end = stream->ra_end = block_id + 1 + stream->window;
+            if(stream->window < CACHE_RA_MAX_WINDOW)
+                stream->window *= 2;
+        }
     }
+    pthread_mutex_unlock(&stream_lock);
+    // the blocks are claimed one shard at a time, with no lock held across the run
+    if(begin < end)
+        cache_readahead(begin, end);
+}
+
+// already hold the shard lock and a reference on block
+// wait for a block someone else is filling, dropping the shard lock meanwhile
+static void cache_wait_fill(cache_shard_t* shard, cache_block_t* block) {
+    while(block->reading)
+        pthread_cond_wait(&shard->cond, &shard->lock);
+    if(block->readahead) {
+        unsigned ticket = block->ticket;
+        pthread_mutex_unlock(&shard->lock);
+        aio_wait(ticket);
+        pthread_mutex_lock(&shard->lock);
+        block->readahead = 0;
+    }
+}
+
+// look up block_id, reading it on a miss if fetch, and take a reference on it
+static cache_block_t* cache_get(uint64_t block_id, int fetch) {
+    // the mapping backend has no transfers to hide
+    int mapped = bios_sd_map(0) != NULL;
+    // a block about to be overwritten says nothing about what will be read next
+    if(!mapped && fetch)
+        cache_stream_access(block_id);
+    cache_shard_t* shard = cache_shard_of(block_id);
+    pthread_mutex_lock(&shard->lock);
+    int meta = cache_is_meta(GET_SECTOR(block_id));
+    shard->stat.lookups++;
+    shard->stat.meta_lookups += meta;
+    cache_block_t* block;
+    int list;
+    while(1) {
+        block = map_cache(shard, block_id);
+        if(block != NULL) {
+            shard->stat.hits++;
+            shard->stat.meta_hits += meta;
+            shard->stat.readahead_hits += block->prefetched;
+            block->refcnt++;
+            cache_wait_fill(shard, block);
+            // the sectors of one block are read one after another, that is a single reference,
+            // and the first use of a block read ahead is its first reference
+            if((page_cache_policy & CACHE_REPLACE_ARC) && shard->lists[CACHE_T1].head != block && !block->prefetched)
+                cache_list_move(shard, block, CACHE_T2);
+            else
+                cache_list_move(shard, block, block->list);
+            block->prefetched = 0;
+            pthread_mutex_unlock(&shard->lock);
+            return block;
+        }
+        // an older copy in the tier or on the device could win over the one on its way
+        if(cache_spilling(shard, block_id)) {
+            pthread_cond_wait(&shard->cond, &shard->lock);
+            continue;
+        }
+        block = cache_frame(shard, block_id, &list, 0);
+        if(block != NULL)
+            break;
+    }
+    shard->stat.misses++;
+    block->block_id = block_id;
+    block->refcnt = 1;
+    if(mapped)
+        block->data = (block_t*)bios_sd_map(GET_SECTOR(block_id));
+    block->reading = (!mapped && fetch) || block->spill;
+    // about to be overwritten as a whole, an older copy must not come back
+    if(!mapped && !fetch)
+        ztier_invalidate(block_id);
+    cache_hash_insert(shard, block);
+    cache_list_add(shard, block, list);
+    if(block->reading) {
+        // lookups of this block wait on the shard cond, the rest of the shard carries on
+        pthread_mutex_unlock(&shard->lock);
+        cache_spill(block);
+        if(fetch && !ztier_load(block_id, block->data))
+            bios_sd_read(KVA2PA(block->data), CACHE_BLOCK_SECTOR, GET_SECTOR(block_id));
+        pthread_mutex_lock(&shard->lock);
+        cache_spill_done(shard, block);
+        block->reading = 0;
+        pthread_cond_broadcast(&shard->cond);
+    }
+    pthread_mutex_unlock(&shard->lock);
     return block;
 }
 
-static void cache_flush_block(cache_block_t* block, uint32_t index) {
-    if(block->dirty) {
-        bios_sd_write(KVA2PA(block->data), 8, GET_SECTOR(block->tag, index));
-        block->dirty = 0;
+// mark the sectors in dirty of a block the caller holds a reference on
+static void cache_dirty(uint64_t block_id, uint8_t dirty) {
+    cache_shard_t* shard = cache_shard_of(block_id);
+    int wakeup = 0;
+    pthread_mutex_lock(&shard->lock);
+    // not an access of its own, the lookup before it already counted
+    cache_block_t* block = map_cache(shard, block_id);
+    assert(block != NULL);
+    if(!block->dirty) {
+        block->dirty_time = now_seconds();
+        wakeup = ++shard->dirty_num == shard->capacity * CACHE_DIRTY_RATIO / 100;
     }
+    block->dirty |= dirty;
+    if(page_cache_policy & CACHE_WRITE_THROUGH)
+        cache_flush_block(shard, block);
+    pthread_mutex_unlock(&shard->lock);
+    if(wakeup)
+        flusher_wakeup();
+}
+
+static void cache_put(uint64_t block_id) {
+    cache_shard_t* shard = cache_shard_of(block_id);
+    pthread_mutex_lock(&shard->lock);
+    cache_block_t* block = map_cache(shard, block_id);
+    assert(block != NULL && block->refcnt > 0);
+    block->refcnt--;
+    pthread_mutex_unlock(&shard->lock);
 }
 
-sector_t* sector_read(uint32_t sector_id) {
-    if(sector_id >= MAX_SECTOR_NUM || sector_id < 0)
+sector_t* sector_read(uint64_t sector_id) {
+    if(sector_id >= bios_sd_sectors())
         return NULL;
-    cache_block_t* block = map_cache(sector_id);
-    if(block != NULL) {
-        return ((sector_t*)(block->data) + GET_OFFSET(sector_id));
-    }
-    if(remain_free_block > 0)
-        block = cache_block_alloc();
-    else{
-        block = cache_lru_replace();
-    }
-    bios_sd_read(KVA2PA(block->data), 8, sector_id & ~OFFSET_MASK);
-    uint32_t index = GET_INDEX(sector_id);
-    block->tag = GET_TAG(sector_id);
-    cache_line_add(block, index);
+    cache_block_t* block = cache_get(GET_BLOCK(sector_id), 1);
     return ((sector_t*)(block->data) + GET_OFFSET(sector_id));
 }
 
-void sector_put(uint32_t sector_id){
-    if(sector_id >= now_superblock->total_sectors || sector_id < 0)
+void sector_put(uint64_t sector_id){
+    if(sector_id >= now_superblock->total_sectors)
         return;
-    int offset = GET_OFFSET(sector_id);
-    cache_block_t* block = map_cache(sector_id);
-    assert(block != NULL);
-    block->dirty = 1;
-    if(page_cache_policy == 1)
-        cache_flush_block(block, GET_INDEX(sector_id));
+    cache_dirty(GET_BLOCK(sector_id), 1 << GET_OFFSET(sector_id));
 }
 
-void cache_flush() {
-    if(page_cache_policy == 1)
+// release the reference taken by sector_read, the sector must not be used after this
+void sector_drop(uint64_t sector_id){
+    if(sector_id >= bios_sd_sectors())
         return;
-    for(int i = 0; i < LINE_NUM; i++) {
-        cache_block_t* p = cache_line[i].head;
-        while(p != NULL) {
-            if(p->dirty) {
-                bios_sd_write(KVA2PA(p->data), 8, GET_SECTOR(p->tag, i));
+    cache_put(GET_BLOCK(sector_id));
+}
+
+block_t* block_read(uint64_t block_id) {
+    if(GET_SECTOR(block_id) >= bios_sd_sectors())
+        return NULL;
+    return cache_get(block_id, 1)->data;
+}
+
+block_t* block_create(uint64_t block_id, int zero) {
+    if(GET_SECTOR(block_id) >= bios_sd_sectors())
+        return NULL;
+    block_t* data = cache_get(block_id, 0)->data;
+    if(zero)
+        memset(data, 0, CACHE_BLOCK_SIZE);
+    return data;
+}
+
+void block_dirty(uint64_t block_id, uint32_t offset, uint32_t len) {
+    if(GET_SECTOR(block_id) >= now_superblock->total_sectors || len == 0)
+        return;
+    assert(offset + len <= CACHE_BLOCK_SIZE);
+    int first = offset / SECTOR_SIZE, last = (offset + len - 1) / SECTOR_SIZE;
+    cache_dirty(block_id, ((1 << (last + 1)) - 1) & ~((1 << first) - 1));
+}
+
+void block_drop(uint64_t block_id) {
+    if(GET_SECTOR(block_id) >= bios_sd_sectors())
+        return;
+    cache_put(block_id);
+}
+
+// write back dirty blocks, only those older than write_back_freq if expired_only
+// and the dirty ratio of their shard is below CACHE_DIRTY_RATIO
+static void cache_writeback(int expired_only) {
+    pthread_mutex_lock(&flush_lock);
+    uint64_t begin = now_ns();
+    uint32_t now = now_seconds();
+    int num = 0;
+    int shard_end[CACHE_SHARDS];
+    // the elevator turns the scattered dirty set into sorted, merged writes
+    for(int s = 0; s < CACHE_SHARDS; s++) {
+        cache_shard_t* shard = &cache_shards[s];
+        pthread_mutex_lock(&shard->lock);
+        int expired = expired_only && shard->dirty_num < shard->capacity * CACHE_DIRTY_RATIO / 100;
+        for(int list = CACHE_T1; list <= CACHE_T2; list++) {
+            for(cache_block_t* p = shard->lists[list].head; p != NULL; p = p->next) {
+                if(!p->dirty || (expired && now - p->dirty_time < (uint32_t)write_back_freq))
+                    continue;
+                io_seg_t segs[CACHE_BLOCK_SECTOR];
+                int num_of_segs = cache_dirty_segs(shard, p, segs);
+                for(int i = 0; i < num_of_segs; i++)
+                    elv_queue_write(segs[i].buf_addr, segs[i].num_of_sectors, segs[i].start_sector_id);
+                // a sector_put from now on dirties the block again and gets it written next round
                 p->dirty = 0;
+                p->writeback = 1;
+                shard->dirty_num--;
+                flush_blocks[num++] = p;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+        shard_end[s] = num;
+    }
+    if(num > 0)
+        elv_dispatch();
+    for(int s = 0, i = 0; s < CACHE_SHARDS; s++) {
+        cache_shard_t* shard = &cache_shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for(; i < shard_end[s]; i++)
+            flush_blocks[i]->writeback = 0;
+        pthread_cond_broadcast(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if(num > 0) {
+        uint64_t elapsed = now_ns() - begin;
+        __atomic_store_n(&flush_rounds, flush_rounds + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&flush_ns, flush_ns + elapsed, __ATOMIC_RELAXED);
+        if(elapsed > flush_max_ns)
+            __atomic_store_n(&flush_max_ns, elapsed, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
+
+void cache_flush() {
+    if(flush_hook != NULL)
+        flush_hook(1);
+    if(page_cache_policy & CACHE_WRITE_THROUGH)
+        return;
+    cache_writeback(0);
+}
+
+static int cache_dirty_num() {
+    int num = 0;
+    for(int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_mutex_lock(&cache_shards[s].lock);
+        num += cache_shards[s].dirty_num;
+        pthread_mutex_unlock(&cache_shards[s].lock);
+    }
+    return num;
+}
+
+static void* cache_flusher(void* arg) {
+    pthread_mutex_lock(&flusher_lock);
+    while(flusher_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CACHE_FLUSH_INTERVAL;
+        // woken early by a shard at the dirty ratio, or by an eviction that found only dirty blocks
+        pthread_cond_timedwait(&flusher_cond, &flusher_lock, &ts);
+        if(!flusher_running)
+            break;
+        pthread_mutex_unlock(&flusher_lock);
+        if(flush_hook != NULL)
+            flush_hook(0);
+        if(cache_dirty_num() > 0)
+            cache_writeback(1);
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+static void flusher_start() {
+    if(flusher_running)
+        return;
+    flusher_running = 1;
+    pthread_create(&flusher, NULL, cache_flusher, NULL);
+}
+
+void fs_cache_release() {
+    if(flusher_running) {
+        pthread_mutex_lock(&flusher_lock);
+        flusher_running = 0;
+        pthread_cond_signal(&flusher_cond);
+        pthread_mutex_unlock(&flusher_lock);
+        pthread_join(flusher, NULL);
+    }
+    if(warmer_running) {
+        __atomic_store_n(&warmer_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(warmer, NULL);
+        warmer_running = 0;
+    }
+    if(cache_arena != NULL) {
+        // blocks still being read ahead land in the arena, which is about to go
+        aio_wait_all();
+        cache_warm_save();
+        cache_flush();
+        munmap(cache_arena, cache_arena_size);
+        cache_arena = NULL;
+        ztier_release();
+        for(int s = 0; s < CACHE_SHARDS; s++) {
+            cache_shard_t* shard = &cache_shards[s];
+            for(int i = 0; i < CACHE_LIST_NUM; i++) {
+                shard->lists[i].head = shard->lists[i].tail = NULL;
+                shard->lists[i].size = 0;
             }
-            p = p->next;
+            shard->capacity = shard->remain_free = 0;
+            pthread_mutex_destroy(&shard->lock);
+            pthread_cond_destroy(&shard->cond);
         }
+        cache_block_num = 0;
     }
 }
 
+static int cache_warm_path(char* path, size_t size) {
+    return snprintf(path, size, "%s%s", get_image_path(), CACHE_WARM_SUFFIX) < (int)size;
+}
+
+static int cache_block_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// prefetch the hottest blocks of the last run, sorted so they are read in one sweep
+static void* cache_warmer(void* arg) {
+    char path[MAX_PATH_LEN];
+    if(!cache_warm_path(path, sizeof(path)))
+        return NULL;
+    FILE* f = fopen(path, "rb");
+    if(f == NULL)
+        return NULL;
+    cache_warm_header_t header;
+    uint64_t* ids = NULL;
+    if(fread(&header, sizeof(header), 1, f) == 1 && header.magic == CACHE_WARM_MAGIC && header.sectors == bios_sd_sectors()) {
+        uint32_t num = header.num;
+        if(num > (uint64_t)cache_block_num * CACHE_WARM_RATIO / 100)
+            num = (uint64_t)cache_block_num * CACHE_WARM_RATIO / 100;
+        ids = malloc((num + 1) * sizeof(uint64_t));
+        header.num = fread(ids, sizeof(uint64_t), num, f);
+    }
+    fclose(f);
+    if(ids == NULL)
+        return NULL;
+    qsort(ids, header.num, sizeof(uint64_t), cache_block_cmp);
+    io_seg_t segs[IO_MAX_SEGS];
+    cache_block_t* run[IO_MAX_SEGS];
+    int num = 0;
+    uint64_t max_block = GET_BLOCK(bios_sd_sectors());
+    for(uint32_t i = 0; i < header.num && !__atomic_load_n(&warmer_stop, __ATOMIC_RELAXED); i++) {
+        if(ids[i] >= max_block || !cache_prefetch(ids[i], segs, run, &num))
+            break;
+        if((i + 1) % CACHE_WARM_BATCH == 0) {
+            cache_readahead_run(segs, run, num);
+            num = 0;
+            aio_submit();
+        }
+    }
+    cache_readahead_run(segs, run, num);
+    aio_submit();
+    free(ids);
+    return NULL;
+}
+
+static void warmer_start() {
+    // the mapping backend has nothing to warm up, its blocks live in the page cache
+    if(!warmup_enabled || bios_sd_map(0) != NULL)
+        return;
+    warmer_stop = 0;
+    warmer_running = pthread_create(&warmer, NULL, cache_warmer, NULL) == 0;
+}
+
+// already stopped the warmer
+// record the resident blocks for the next fs_cache_init, the most recently used of every shard
+// first, so that a smaller cache next time gets the hottest of them
+static void cache_warm_save() {
+    char path[MAX_PATH_LEN];
+    if(!warmup_enabled || bios_sd_map(0) != NULL || !cache_warm_path(path, sizeof(path)))
+        return;
+    uint64_t* ids = malloc(cache_block_num * sizeof(uint64_t));
+    uint32_t num = 0;
+    cache_block_t* cursor[CACHE_SHARDS];
+    for(int s = 0; s < CACHE_SHARDS; s++)
+        cursor[s] = cache_shards[s].lists[CACHE_T2].head != NULL ? cache_shards[s].lists[CACHE_T2].head : cache_shards[s].lists[CACHE_T1].head;
+    for(int left = 1; left; ) {
+        left = 0;
+        for(int s = 0; s < CACHE_SHARDS; s++) {
+            cache_block_t* block = cursor[s];
+            if(block == NULL)
+                continue;
+            left = 1;
+            // read ahead and never used says nothing about the next run
+            if(!block->prefetched)
+                ids[num++] = block->block_id;
+            cursor[s] = block->next;
+            if(cursor[s] == NULL && block->list == CACHE_T2)
+                cursor[s] = cache_shards[s].lists[CACHE_T1].head;
+        }
+    }
+    cache_warm_header_t header = { CACHE_WARM_MAGIC, num, bios_sd_sectors() };
+    FILE* f = fopen(path, "wb");
+    if(f != NULL) {
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(ids, sizeof(uint64_t), num, f);
+        fclose(f);
+    }
+    free(ids);
+}
+
+void change_cache_warmup(int enable) {
+    warmup_enabled = enable;
+}
+
+void change_cache_flush_hook(void (*hook)(int all)) {
+    flush_hook = hook;
+}
+
 void change_cache_policy(int policy) {
-    if(page_cache_policy == 0 && policy == 1)
+    if(!(page_cache_policy & CACHE_WRITE_THROUGH) && (policy & CACHE_WRITE_THROUGH) && cache_arena != NULL)
         cache_flush();
+    if(cache_arena == NULL) {
+        page_cache_policy = policy;
+        return;
+    }
+    // every shard is locked, in order, so no lookup sees half of the switch
+    for(int s = 0; s < CACHE_SHARDS; s++)
+        pthread_mutex_lock(&cache_shards[s].lock);
+    for(int s = 0; s < CACHE_SHARDS; s++) {
+        cache_shard_t* shard = &cache_shards[s];
+        if((page_cache_policy & CACHE_REPLACE_ARC) && !(policy & CACHE_REPLACE_ARC)) {
+            // back to one LRU list: T2 is more recent than T1 as a whole, ghosts are dropped
+            while(shard->lists[CACHE_T2].tail != NULL)
+                cache_list_move(shard, shard->lists[CACHE_T2].tail, CACHE_T1);
+            while(shard->lists[CACHE_B1].tail != NULL)
+                ghost_release(shard, shard->lists[CACHE_B1].tail);
+            while(shard->lists[CACHE_B2].tail != NULL)
+                ghost_release(shard, shard->lists[CACHE_B2].tail);
+        }
+        shard->arc_p = 0;
+    }
     page_cache_policy = policy;
+    for(int s = CACHE_SHARDS - 1; s >= 0; s--)
+        pthread_mutex_unlock(&cache_shards[s].lock);
+}
+
+void change_cache_size(uint64_t size) {
+    if(size < CACHE_MIN_SIZE)
+        size = CACHE_MIN_SIZE;
+    cache_size = size / CACHE_BLOCK_SIZE * CACHE_BLOCK_SIZE;
+}
+
+uint64_t get_cache_size() {
+    return cache_size;
+}
+
+int get_cache_arena() {
+    return cache_arena_type;
+}
+
+int get_cache_policy() {
+    return page_cache_policy;
+}
+
+void cache_get_stat(cache_stat_t* stat) {
+    memset(stat, 0, sizeof(*stat));
+    for(int s = 0; s < CACHE_SHARDS && cache_arena != NULL; s++) {
+        cache_shard_t* shard = &cache_shards[s];
+        pthread_mutex_lock(&shard->lock);
+        stat->lookups += shard->stat.lookups;
+        stat->hits += shard->stat.hits;
+        stat->misses += shard->stat.misses;
+        stat->meta_lookups += shard->stat.meta_lookups;
+        stat->meta_hits += shard->stat.meta_hits;
+        stat->evictions += shard->stat.evictions;
+        stat->readaheads += shard->stat.readaheads;
+        stat->readahead_hits += shard->stat.readahead_hits;
+        stat->writebacks += shard->stat.writebacks;
+        stat->writeback_sectors += shard->stat.writeback_sectors;
+        stat->dirty_blocks += shard->dirty_num;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stat->flushes = __atomic_load_n(&flush_rounds, __ATOMIC_RELAXED);
+    stat->flush_ns = __atomic_load_n(&flush_ns, __ATOMIC_RELAXED);
+    stat->flush_max_ns = __atomic_load_n(&flush_max_ns, __ATOMIC_RELAXED);
+}
+
+void cache_reset_stat() {
+    for(int s = 0; s < CACHE_SHARDS && cache_arena != NULL; s++) {
+        cache_shard_t* shard = &cache_shards[s];
+        pthread_mutex_lock(&shard->lock);
+        memset(&shard->stat, 0, sizeof(shard->stat));
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_lock(&flush_lock);
+    __atomic_store_n(&flush_rounds, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&flush_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&flush_max_ns, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&flush_lock);
 }
 
 void change_write_back_freq(int freq) {
     write_back_freq = freq;
-}
\ No newline at end of file
+}
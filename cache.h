@@ -1,30 +1,81 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <pthread.h>
 #include "grfs.h"
 
-#define TOTAL_MAX_CACHE_SIZE (128 * 1024 * 1024)
+// bytes of block data, see change_cache_size
+#define CACHE_DEFAULT_SIZE (128 * 1024 * 1024)
+#define CACHE_MIN_SIZE (4 * 1024 * 1024)
 
 #define CACHE_BLOCK_SIZE BLOCK_SIZE
 #define CACHE_BLOCK_SECTOR SECTOR_IN_BLOCK
+#define CACHE_DIRTY_ALL ((1 << CACHE_BLOCK_SECTOR) - 1)
+
+// the block data and the metadata share one arena, backed by huge pages when possible
+#define CACHE_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define CACHE_ARENA_PAGES 0   // plain 4 KiB pages
+#define CACHE_ARENA_THP 1     // transparent huge pages requested with madvise
+#define CACHE_ARENA_HUGETLB 2 // explicit huge pages, MAP_HUGETLB
+
+// resident blocks plus as many ghost entries, kept at most half full so probe chains stay short
+#define CACHE_HASH_FACTOR 4
+#define CACHE_HASH_EMPTY (-1)
+
+// the cache is split by block hash into shards with their own lock, lists and free blocks
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+
+// the flusher wakes up this often and writes back blocks dirty for write_back_freq seconds
+#define CACHE_FLUSH_INTERVAL 5
+// percent of the cache allowed to be dirty before the flusher writes everything back
+#define CACHE_DIRTY_RATIO 10
+// blocks looked at from the cold end for a clean victim before writing one back in place
+#define CACHE_EVICT_SCAN 64
+// evicted blocks of a shard stored into the compressed tier outside the shard lock at a time
+#define CACHE_SPILL_MAX 8
+
+// sequential streams tracked for readahead, by physical block
+#define CACHE_RA_STREAMS 8
+// readahead window in blocks, doubled on every trigger while a stream stays sequential
+#define CACHE_RA_MIN_WINDOW 4
+#define CACHE_RA_MAX_WINDOW 128
+
+// the resident blocks, hottest first, are saved to the image path + CACHE_WARM_SUFFIX by
+// fs_cache_release and read back in the background by fs_cache_init
+#define CACHE_WARM_SUFFIX ".warm"
+#define CACHE_WARM_MAGIC 0x324D5257
+// percent of the cache the warm-up may fill, the rest is left to the first requests
+#define CACHE_WARM_RATIO 50
+// blocks queued before the warm-up submits them and gives way to the file system
+#define CACHE_WARM_BATCH 256
+
+// compressed second tier for clean blocks evicted from the cache (ztier.c), off unless sized
+#define ZTIER_MIN_ENTRY 256 // log bytes per entry slot, blocks compressing better share the slots
+#define ZTIER_MIN_GAIN 512  // bytes a block must compress by, else it is kept raw
+#define ZTIER_RAW CACHE_BLOCK_SIZE
+
+// policy passed to change_cache_policy: a write mode or'ed with a replacement policy
+#define CACHE_WRITE_BACK 0x0
+#define CACHE_WRITE_THROUGH 0x1
+#define CACHE_WRITE_MASK 0x1
+#define CACHE_REPLACE_LRU 0x0
+#define CACHE_REPLACE_ARC 0x2 // adaptive replacement, a single scan cannot flush frequently used blocks
+#define CACHE_REPLACE_MASK 0x2
+
+// lists a cache entry can be on, LRU only uses CACHE_T1
+#define CACHE_T1 0 // resident, seen once recently
+#define CACHE_T2 1 // resident, seen at least twice recently
+#define CACHE_B1 2 // ghost of a block evicted from T1
+#define CACHE_B2 3 // ghost of a block evicted from T2
+#define CACHE_LIST_NUM 4
 
-#define WAY_NUM 4
-#define LINE_NUM 64
-
-#define INPUT_BITS 32
-#define TAG_BITS 23
-#define INDEX_BITS 6
 #define OFFSET_BITS 3
-
 #define OFFSET_MASK 0x7
-#define INDEX_MASK 0x1F8
-#define TAG_MASK 0xFFFFFE
 
 #define GET_OFFSET(addr) ((addr) & OFFSET_MASK)
-#define GET_INDEX(addr) (((addr) & INDEX_MASK) >> OFFSET_BITS)
-#define GET_TAG(addr) (((addr) & TAG_MASK) >> (OFFSET_BITS + INDEX_BITS))
-
-#define GET_SECTOR(tag, index) (tag << (INDEX_BITS + OFFSET_BITS) | index << OFFSET_BITS)
+#define GET_BLOCK(addr) ((uint64_t)(addr) >> OFFSET_BITS)
+#define GET_SECTOR(block) ((uint64_t)(block) << OFFSET_BITS)
 
 typedef struct {
     char data[SECTOR_SIZE];
@@ -35,25 +86,146 @@ typedef struct {
 } block_t;
 
 typedef struct cache_block {
-    uint32_t tag : 30;
+    uint64_t block_id; // sector_id >> OFFSET_BITS
     unsigned char valid : 1;
-    unsigned char dirty : 1;
-    block_t* data;
-    struct cache_block* next;
+    uint8_t dirty; // one bit per sector of the block
+    unsigned char list : 2;
+    unsigned char writeback : 1; // being written by the flusher, must not be evicted
+    unsigned char readahead : 1; // being read ahead, wait for ticket before use
+    unsigned char prefetched : 1; // read ahead and not yet referenced
+    unsigned char reading : 1; // filled outside the shard lock, wait on the shard cond before use
+    unsigned char spill : 1; // evicted, spill_id still goes to the compressed tier, see cache_evict
+    unsigned ticket;
+    int refcnt; // references handed out by sector_read and not dropped yet, never evicted while > 0
+    uint32_t dirty_time; // seconds, when the block became dirty
+    uint64_t spill_id;
+    block_t* data; // NULL for a ghost
+    struct cache_block *prev, *next; // most recently used at the head
 } cache_block_t;
 
 typedef struct {
     cache_block_t *head, *tail;
     int size;
-} cache_line_t;
+} cache_list_t;
 
+typedef struct {
+    uint64_t next_block; // the block a sequential reader touches next
+    uint64_t ra_end;     // first block not read ahead yet
+    int window;
+    unsigned last_use;
+} cache_stream_t;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t meta_lookups; // superblock, bitmaps and inode table
+    uint64_t meta_hits;
+    uint64_t evictions; // resident blocks given up for another block
+    uint64_t readaheads; // blocks read ahead
+    uint64_t readahead_hits; // blocks read ahead and used before being evicted
+    uint64_t writebacks; // dirty blocks written back
+    uint64_t writeback_sectors; // sectors written back
+    uint64_t dirty_blocks; // dirty right now, not cleared by cache_reset_stat
+    uint64_t flushes; // write-back rounds that wrote something, by the flusher or cache_flush
+    uint64_t flush_ns; // time spent in them
+    uint64_t flush_max_ns;
+} cache_stat_t;
+
+typedef struct {
+    uint64_t stores;
+    uint64_t stored_bytes; // after compression, CACHE_BLOCK_SIZE per store before
+    uint64_t lookups; // cache misses looked up in the tier
+    uint64_t hits;
+    uint64_t evictions; // entries overwritten in the log before they were used
+    uint64_t entries; // blocks held right now
+    uint64_t used_bytes;
+} ztier_stat_t;
+
+// followed by num block numbers, uint64_t each
+typedef struct {
+    uint32_t magic;
+    uint32_t num;
+    uint64_t sectors; // of the device the blocks were saved for
+} cache_warm_header_t;
+
+typedef struct {
+    pthread_mutex_t lock; // protects everything below and the blocks of the shard
+    pthread_cond_t cond;  // broadcast when a block of the shard finishes reading or writing back
+    cache_block_t* blocks; // capacity entries of cache_block, handed out from the end
+    cache_block_t* ghosts; // as many entries of cache_ghost
+    int capacity;
+    int remain_free;
+    cache_block_t* ghost_free;
+    int* hash; // block number -> entry, < cache_block_num for cache_block and above for cache_ghost
+    uint32_t hash_mask;
+    cache_list_t lists[CACHE_LIST_NUM];
+    int arc_p; // ARC target size of T1
+    int dirty_num;
+    uint64_t spills[CACHE_SPILL_MAX]; // blocks of evicted frames on their way to the compressed tier
+    int spill_num;
+    cache_stat_t stat;
+} cache_shard_t;
+
+
+/**
+ * @brief set the bytes of block data the cache holds, must be called before init_fs
+ * @note rounded down to whole blocks, at least CACHE_MIN_SIZE
+ */
+void change_cache_size(uint64_t size);
+uint64_t get_cache_size();
+
+/**
+ * @brief get how the arena is backed, CACHE_ARENA_*, valid after init_fs
+ */
+int get_cache_arena();
 
 int fs_cache_init();
-sector_t* sector_read(uint32_t sector_id);
-void sector_put(uint32_t sector_id);
+void fs_cache_release();
+// sector_read pins the block of the sector, every call is paired with a sector_drop
+sector_t* sector_read(uint64_t sector_id);
+void sector_put(uint64_t sector_id);
+void sector_drop(uint64_t sector_id);
+
+// the same for a whole block, block_id is the device block (sector_id >> OFFSET_BITS),
+// block_dirty marks the sectors overlapping [offset, offset + len)
+block_t* block_read(uint64_t block_id);
+// like block_read without reading the device, for a block about to be overwritten as a whole,
+// zero-filled if zero, the caller still marks it with block_dirty
+block_t* block_create(uint64_t block_id, int zero);
+void block_dirty(uint64_t block_id, uint32_t offset, uint32_t len);
+void block_drop(uint64_t block_id);
 void cache_flush();
 void change_cache_policy(int policy);
+int get_cache_policy();
+// the counters are kept per shard under its lock, so they cost no extra synchronization
+void cache_get_stat(cache_stat_t* stat);
+void cache_reset_stat();
 void change_write_back_freq(int freq);
+// on by default, must be called before init_fs
+void change_cache_warmup(int enable);
+// called without any cache lock held before the flusher (all = 0) or cache_flush (all = 1) writes back,
+// for the file system to turn the data it keeps outside the cache into dirty blocks
+void change_cache_flush_hook(void (*hook)(int all));
+
+/**
+ * @brief set the bytes of memory of the compressed tier, 0 (the default) turns it off
+ * @note must be called before init_fs
+ */
+void change_ztier_size(uint64_t size);
+uint64_t get_ztier_size();
+void ztier_init();
+void ztier_release();
+// 1 once ztier_init has reserved the tier
+int ztier_enabled();
+// store a clean block the cache gives up, replacing an older copy
+void ztier_store(uint64_t block_id, const void* data);
+// fill data with block_id and take it out of the tier, 0 if it is not there
+int ztier_load(uint64_t block_id, void* data);
+// forget block_id, whose copy on the device is about to change
+void ztier_invalidate(uint64_t block_id);
+void ztier_get_stat(ztier_stat_t* stat);
+void ztier_reset_stat();
 
 
 #endif /* CACHE_H */
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "io.h"
+
+static io_seg_t* elv_queue = NULL;
+static int elv_queue_num = 0;
+static int elv_queue_size = 0;
+static uint64_t elv_head = 0; // sector after the last dispatched request
+
+static pthread_mutex_t elv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int elv_cmp(const void* a, const void* b){
+    uint64_t sa = ((io_seg_t*)a)->start_sector_id;
+    uint64_t sb = ((io_seg_t*)b)->start_sector_id;
+    return (sa > sb) - (sa < sb);
+}
+
+void elv_queue_write(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id){
+    pthread_mutex_lock(&elv_lock);
+    if(elv_queue_num == elv_queue_size){
+        elv_queue_size = elv_queue_size ? elv_queue_size * 2 : 1024;
+        elv_queue = realloc(elv_queue, elv_queue_size * sizeof(io_seg_t));
+        assert(elv_queue != NULL);
+    }
+    elv_queue[elv_queue_num].buf_addr = buf_addr;
+    elv_queue[elv_queue_num].num_of_sectors = num_of_sectors;
+    elv_queue[elv_queue_num].start_sector_id = start_sector_id;
+    elv_queue_num++;
+    pthread_mutex_unlock(&elv_lock);
+}
+
+// hand segs to aio as requests of adjacent segments, each at most ELV_MAX_REQUEST_SECTORS
+static void elv_issue(io_seg_t* segs, int num_of_segs){
+    while(num_of_segs > 0){
+        int len = 1;
+        unsigned sectors = segs[0].num_of_sectors;
+        while(len < num_of_segs && len < IO_MAX_SEGS
+            && segs[len-1].start_sector_id + segs[len-1].num_of_sectors == segs[len].start_sector_id
+            && sectors + segs[len].num_of_sectors <= ELV_MAX_REQUEST_SECTORS){
+            sectors += segs[len].num_of_sectors;
+            len++;
+        }
+        aio_writev(segs, len);
+        elv_head = segs[len-1].start_sector_id + segs[len-1].num_of_sectors;
+        segs += len;
+        num_of_segs -= len;
+    }
+}
+
+void elv_dispatch(){
+    pthread_mutex_lock(&elv_lock);
+    if(elv_queue_num > 0){
+        qsort(elv_queue, elv_queue_num, sizeof(io_seg_t), elv_cmp);
+        // C-LOOK: sweep up from where the last dispatch stopped, then wrap around
+        int first = 0;
+        while(first < elv_queue_num && elv_queue[first].start_sector_id < elv_head)
+            first++;
+        elv_issue(elv_queue + first, elv_queue_num - first);
+        elv_issue(elv_queue, first);
+        elv_queue_num = 0;
+    }
+    pthread_mutex_unlock(&elv_lock);
+    aio_wait_all();
+}
@@ -4,26 +4,136 @@
 #include "cache.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 spinlock_t fs_lock;
 superblock_t* now_superblock;
 
+// in-memory state of an on-disk bitmap, set up when the file system is mounted
+typedef struct {
+    uint64_t begin_sector; // of the slice in group 0, the slices of the groups are GROUP_SECTORS apart
+    uint32_t group_sectors; // bitmap sectors in each slice
+    uint32_t sectors;
+    uint32_t max_bits;
+    uint32_t cursor; // next fit, a search starts after the last bit allocated
+    int* free_bits; // free bits per bitmap sector, -1 until the sector is counted
+} bitmap_t;
+
+static bitmap_t block_bitmap, inode_bitmap;
+
+// blocks taken ahead of a file being written, handed out in order so the file grows contiguously
+typedef struct {
+    int ino; // -1 when the slot is unused
+    int next; // next block of the window to hand out, -1 before the first window
+    int end;
+    int window; // blocks of the next window, doubled on every refill
+    int want; // blocks the write in progress still needs
+} prealloc_t;
+
+static prealloc_t preallocs[PREALLOC_SLOTS];
+static int prealloc_clock;
+
+// a block written into a hole while delayed allocation is on, mapped by delalloc_flush_inode
+typedef struct delalloc_block {
+    int ino;
+    int block_index;
+    struct delalloc_block* next; // of the same inode
+    struct delalloc_block* hash_next;
+    block_t data;
+} delalloc_block_t;
+
+typedef struct {
+    int ino; // -1 when the slot is unused
+    int num;
+    uint32_t since; // seconds, when its first block was delayed
+    delalloc_block_t* blocks;
+    int first, last; // lowest and highest block index delayed
+    int depths; // sum of the indirection depths of the blocks
+    int reserve; // indirect blocks mapping them may need, counted in delalloc_reserved
+} delalloc_inode_t;
+
+static int delalloc_enabled;
+static int delalloc_num; // delayed blocks, counted as used by the allocators
+static int delalloc_reserved; // indirect blocks for them, counted as used too
+static delalloc_inode_t delalloc_inodes[DELALLOC_INODES];
+static delalloc_block_t* delalloc_hash[DELALLOC_HASH];
+
+// blocks given back together, a run of adjacent blocks is cleared in the bitmap at once
+typedef struct {
+    int start;
+    int len; // of the run being gathered
+    int total; // blocks released, the superblock is updated once at the end
+} release_batch_t;
+
 static int check_fs_in_sd();
 static void init_superblock();
 static void init_inode(int parent_ino, int self_ino, int dir_tag);
 static int inode_mapto_block(int ino, int block_index, int alloc);
-static int alloc_inode();
+static void bitmap_load(bitmap_t* map, uint64_t begin_sector, uint32_t group_sectors, uint32_t sectors, uint32_t max_bits);
+static uint64_t bitmap_sector(bitmap_t* map, uint32_t index);
+static void bitmap_unload(bitmap_t* map);
+static void load_bitmaps();
+static int bitmap_free_bits(bitmap_t* map, uint32_t index);
+static int bitmap_alloc(bitmap_t* map, uint32_t goal);
+static void bitmap_clear(bitmap_t* map, uint32_t bit);
+static void bitmap_set_range(bitmap_t* map, uint32_t start, uint32_t len, int set);
+static int bitmap_scan_run(const uint64_t* words, uint32_t base, int from, int min, int max, uint32_t* run_start, int* run_len);
+static int bitmap_alloc_run(bitmap_t* map, uint32_t goal, int min, int max, int* len);
+static uint64_t group_sector(int group);
+static groupdesc_t* get_groupdesc(int group);
+static void put_groupdesc(int group);
+static void drop_groupdesc(int group);
+static void group_account_blocks(int block_id, int len, int release);
+static int group_fits(int group, int need_blocks);
+static int find_group_dir();
+static int find_group_other(int parent_group);
+static int inode_goal(int ino);
+static int alloc_inode(int parent_ino, int dir);
 static int release_inode(int ino);
-static int alloc_block();
-static int release_block(int block_id);
-static int release_block_recursive(int block_id, int depth);
+static int free_blocks();
+static int alloc_block(int goal);
+static int alloc_blocks(int goal, int min, int max, int* len);
+static void release_blocks(int block_id, int len);
+static prealloc_t* prealloc_find(int ino, int create);
+static void prealloc_discard(prealloc_t* pa);
+static int prealloc_reclaim();
+static int prealloc_held();
+static prealloc_t* prealloc_start(int ino, int block_index, int want);
+static int alloc_file_block(int ino);
+static delalloc_block_t** delalloc_bucket(int ino, int block_index);
+static delalloc_block_t* delalloc_lookup(int ino, int block_index);
+static delalloc_block_t* delalloc_get(int ino, int block_index);
+static int block_depth(int block_index);
+static int delalloc_indirect(int first, int last);
+static void delalloc_link(delalloc_inode_t* di, delalloc_block_t* block);
+static void delalloc_account(delalloc_inode_t* di);
+static int delalloc_block_cmp(const void* a, const void* b);
+static void delalloc_unhash(delalloc_block_t* block);
+static void delalloc_flush_inode(delalloc_inode_t* di);
+static void delalloc_flush(int all);
+static void delalloc_discard(int ino, int from);
+static void delalloc_flush_hook(int all);
+static int inode_is_open(int ino);
+static void release_batch_run(release_batch_t* batch);
+static void release_batch_add(release_batch_t* batch, int block_id);
+static void release_batch_end(release_batch_t* batch);
+static int release_tree(release_batch_t* batch, int block_id, int depth, int from);
+static void release_file_blocks(int ino, int keep);
+static void inode_resize(int ino, int size);
+static uint64_t inode_sector(int ino);
 static inode_t* get_inode(int ino);
 static int put_inode(int ino);
-static sector_t* get_sector_of_block(int block_id, int sector_index);
-static int put_sector_of_block(int block_id, int sector_index);
+static void drop_inode(int ino);
+static block_t* get_block(int block_id);
+static block_t* get_new_block(int block_id, int zero);
+static int put_block(int block_id, uint32_t offset, uint32_t len);
+static void drop_block(int block_id);
+static void init_new_block(int block_id, int indirect);
+static int indirect_lookup(int ino, int indirect_block_id, int index, int alloc, int init);
 static int set_dentry(int ino, char* name, dentry_t* dentry);
-static void init_dentry_arr(dentry_t* dentry, int parent_ino, int self_ino, int first);
+static void init_dentry_arr(dentry_t* dentry, int parent_ino, int self_ino);
 static dentry_t* find_dentry_byname(char* name, int* count, dentry_t* dentrys, int dentry_num);
 static dentry_t* find_dentry_byino(int ino, int* count, dentry_t* dentrys, int dentry_num);
 static dentry_t* find_empty_dentry(dentry_t* dentrys, int dentry_num);
@@ -38,18 +148,25 @@ static char* get_name_and_ino_by_path(char* path, int* ret_ino);
 
 
 static int check_fs_in_sd(){
-    now_superblock = (superblock_t*)sector_read(FILE_SYSTEM_BEGIN_SECTOR + SUPERBLOCK_BEGIN_SECTOR);
+    // the superblock stays pinned while the file system is mounted
+    if(now_superblock == NULL)
+        now_superblock = (superblock_t*)sector_read(FILE_SYSTEM_BEGIN_SECTOR + SUPERBLOCK_BEGIN_SECTOR);
     int ret = 1;
-    if(now_superblock->magic!= SUPERBLOCK_MAGIC)
+    if(now_superblock->magic == SUPERBLOCK_MAGIC_V1)// an older layout, its data must not be formatted over
+        ret = -1;
+    else if(now_superblock->magic!= SUPERBLOCK_MAGIC)
         ret = 0;
+    else // the geometry comes from the superblock, the device must be large enough for it
+        assert(FILE_SYSTEM_BEGIN_SECTOR + (uint64_t)now_superblock->total_sectors <= bios_sd_sectors());
     return ret;
 }
 
-static void clear_map(int begin_sector, int occupied_sectors){
+static void clear_map(uint64_t begin_sector, int occupied_sectors){
     for(int i = 0; i < occupied_sectors; i++){
         sector_t* sector = sector_read(begin_sector + i);
         memset(sector, 0, SECTOR_SIZE);
         sector_put(begin_sector + i);
+        sector_drop(begin_sector + i);
     }
 }
 
@@ -57,36 +174,66 @@ static void init_superblock(){
     assert(sizeof(superblock_t) == SECTOR_SIZE);
     assert(sizeof(inode_t) == INODE_SIZE);
     assert(sizeof(dentry_t) == DENTRY_SIZE);
-    now_superblock = (superblock_t*)sector_read(FILE_SYSTEM_BEGIN_SECTOR + SUPERBLOCK_BEGIN_SECTOR);
+    // check_fs_in_sd has pinned the superblock
     now_superblock->magic = SUPERBLOCK_MAGIC;
     now_superblock->superblock_sector = FILE_SYSTEM_BEGIN_SECTOR + SUPERBLOCK_BEGIN_SECTOR;
     now_superblock->begin_sector = FILE_SYSTEM_BEGIN_SECTOR;
-    now_superblock->total_sectors = MAX_SECTOR_NUM;
     memcpy(now_superblock->name, FILE_SYSTEM_NAME, sizeof(FILE_SYSTEM_NAME) - 1);
 
-    now_superblock->inodemap_begin_sector = FILE_SYSTEM_BEGIN_SECTOR + INODEMAP_BEGIN_SECTOR;
-    now_superblock->inodemap_occupied_sectors = INODEMAP_OCCUPIED_SECTORS;
+    // the layout is sized from the device, sector counts on disk are 32-bit
+    uint64_t total_sectors = bios_sd_sectors() - FILE_SYSTEM_BEGIN_SECTOR;
+    if(total_sectors > 0xFFFFFFFF)
+        total_sectors = 0xFFFFFFFF;
+    // descriptors for as many groups as the device could hold, then the groups,
+    // the last one kept if it is at least GROUP_MIN_BLOCKS long
+    uint32_t groupdesc_sectors = (total_sectors / GROUP_SECTORS + 1 + GROUPDESCS_IN_SECTOR - 1) / GROUPDESCS_IN_SECTOR;
+    uint32_t block_table_begin = GROUPDESC_BEGIN_SECTOR + groupdesc_sectors;
+    block_table_begin = (block_table_begin + SECTOR_IN_BLOCK - 1) / SECTOR_IN_BLOCK * SECTOR_IN_BLOCK;
+    assert(block_table_begin < total_sectors);
+    uint32_t total_blocks = (total_sectors - block_table_begin) / SECTOR_IN_BLOCK;
+    uint32_t group_num = total_blocks / GROUP_BLOCKS;
+    if(total_blocks % GROUP_BLOCKS >= GROUP_MIN_BLOCKS)
+        group_num++;
+    else
+        total_blocks = group_num * GROUP_BLOCKS;
+    assert(group_num > 0);
+    now_superblock->total_sectors = total_sectors;
 
-    now_superblock->blockmap_begin_sector = FILE_SYSTEM_BEGIN_SECTOR + BLOCKMAP_BEGIN_SECTOR;
-    now_superblock->blockmap_occupied_sectors = BLOCKMAP_OCCUPIED_SECTORS;
+    now_superblock->groupdesc_begin_sector = FILE_SYSTEM_BEGIN_SECTOR + GROUPDESC_BEGIN_SECTOR;
+    now_superblock->groupdesc_occupied_sectors = groupdesc_sectors;
+    now_superblock->group_num = group_num;
+    now_superblock->group_blocks = GROUP_BLOCKS;
+    now_superblock->group_inodes = GROUP_INODES;
 
-    now_superblock->inode_table_begin_sector = FILE_SYSTEM_BEGIN_SECTOR + INODE_TABLE_BEGIN_SECTOR;
-    now_superblock->inode_table_occupied_sectors = INODE_TABLE_OCCUPIED_SECTORS;
     now_superblock->inode_size = INODE_SIZE;
     now_superblock->inode_num = 0;
-    now_superblock->inode_max_num = INODE_MAX_NUM;
+    now_superblock->inode_max_num = group_num * GROUP_INODES;
 
-    now_superblock->block_table_begin_sector = FILE_SYSTEM_BEGIN_SECTOR + BLOCK_TABLE_BEGIN_SECTOR;
-    now_superblock->block_table_occupied_sectors = BLOCK_TABLE_OCCUPIED_SECTORS;
+    now_superblock->block_table_begin_sector = FILE_SYSTEM_BEGIN_SECTOR + block_table_begin;
+    now_superblock->block_table_occupied_sectors = total_blocks * SECTOR_IN_BLOCK;
     now_superblock->block_size = BLOCK_SIZE;
-    now_superblock->block_num = 0;
-    now_superblock->block_max_num = BLOCK_MAX_NUM;
-
-    clear_map(now_superblock->inodemap_begin_sector, now_superblock->inodemap_occupied_sectors);
-    clear_map(now_superblock->blockmap_begin_sector, now_superblock->blockmap_occupied_sectors);
+    now_superblock->block_max_num = total_blocks;
+
+    clear_map(now_superblock->groupdesc_begin_sector, groupdesc_sectors);
+    for(uint32_t group = 0; group < group_num; group++)
+        clear_map(group_sector(group), GROUP_BLOCKMAP_SECTORS + GROUP_INODEMAP_SECTORS);
+    load_bitmaps();
+    // the metadata blocks at the head of every group are used from the start
+    for(uint32_t group = 0; group < group_num; group++){
+        uint32_t first = group * GROUP_BLOCKS;
+        uint32_t blocks = total_blocks - first < GROUP_BLOCKS ? total_blocks - first : GROUP_BLOCKS;
+        bitmap_set_range(&block_bitmap, first, GROUP_META_BLOCKS, 1);
+        groupdesc_t* desc = get_groupdesc(group);
+        desc->free_blocks = blocks - GROUP_META_BLOCKS;
+        desc->free_inodes = GROUP_INODES;
+        desc->dir_num = 0;
+        put_groupdesc(group);
+        drop_groupdesc(group);
+    }
+    now_superblock->block_num = group_num * GROUP_META_BLOCKS;
     cache_flush();
 
-    now_superblock->root_ino = alloc_inode();
+    now_superblock->root_ino = alloc_inode(-1, 1);
     init_inode(now_superblock->root_ino, now_superblock->root_ino, 1);
 
     sector_put(FILE_SYSTEM_BEGIN_SECTOR + SUPERBLOCK_BEGIN_SECTOR);
@@ -112,15 +259,43 @@ static void init_inode(int parent_ino, int self_ino, int dir_tag){
     
     if(dir_tag){
         inode->size = 2;
-        inode->block_ptr[0] = alloc_block();
+        inode->block_ptr[0] = alloc_block(inode_goal(self_ino));
 
-        for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-            dentry_t* root_dentry = (dentry_t*)get_sector_of_block(inode->block_ptr[0], i);
-            init_dentry_arr(root_dentry, parent_ino, self_ino, (i==0));
-            put_sector_of_block(inode->block_ptr[0], i);
-        }
+        dentry_t* root_dentry = (dentry_t*)get_new_block(inode->block_ptr[0], 0);
+        init_dentry_arr(root_dentry, parent_ino, self_ino);
+        put_block(inode->block_ptr[0], 0, BLOCK_SIZE);
+        drop_block(inode->block_ptr[0]);
     }
     put_inode(self_ino);
+    drop_inode(self_ino);
+}
+
+static void init_new_block(int block_id, int indirect){
+    // already hold the fs_lock
+    // the old contents of a new block are never read: indirect blocks start with no entries, data blocks with zeros
+    int* blockids = (int*)get_new_block(block_id, !indirect);
+    if(indirect)
+        for(int i = 0; i < INODE_INDIRECT1_BLOCK; i++)
+            blockids[i] = -1;
+    put_block(block_id, 0, BLOCK_SIZE);
+    drop_block(block_id);
+}
+
+static int indirect_lookup(int ino, int indirect_block_id, int index, int alloc, int init){
+    // already hold the fs_lock
+    // entry index of an indirect block of ino, init when the new block is an indirect block itself
+    int* blockids = (int*)get_block(indirect_block_id);
+    int ret = blockids[index];
+    if(ret == -1 && alloc){
+        ret = alloc_file_block(ino);
+        if(ret != -1){
+            blockids[index] = ret;
+            put_block(indirect_block_id, index * 4, 4);
+            init_new_block(ret, init);
+        }
+    }
+    drop_block(indirect_block_id);
+    return ret;
 }
 
 static int inode_mapto_block(int ino, int block_index, int alloc){
@@ -128,220 +303,350 @@ static int inode_mapto_block(int ino, int block_index, int alloc){
     assert(ino < now_superblock->inode_max_num && ino >= 0);
     inode_t* inode = (inode_t*)get_inode(ino);
 
+    uint32_t* root_ptr;
+    int depth;
     if(block_index < INODE_DIRECT_BLOCK){
-        if(inode->block_ptr[block_index] == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            inode->block_ptr[block_index] = new_block_id;
+        root_ptr = &inode->block_ptr[block_index];
+        depth = 0;
+    } else if((block_index -= INODE_DIRECT_BLOCK) < INODE_INDIRECT1_BLOCK){
+        root_ptr = &inode->indirect1_ptr;
+        depth = 1;
+    } else if((block_index -= INODE_INDIRECT1_BLOCK) < INODE_INDIRECT2_BLOCK){
+        root_ptr = &inode->indirect2_ptr;
+        depth = 2;
+    } else if((block_index -= INODE_INDIRECT2_BLOCK) < INODE_INDIRECT3_BLOCK){
+        root_ptr = &inode->indirect3_ptr;
+        depth = 3;
+    } else {
+        drop_inode(ino);
+        return -1;
+    }
+
+    int block_id = *root_ptr;
+    if(block_id == -1 && alloc){
+        block_id = alloc_file_block(ino);
+        if(block_id != -1){
+            *root_ptr = block_id;
             put_inode(ino);
+            init_new_block(block_id, depth > 0);
         }
-        return inode->block_ptr[block_index];
-    } 
-
-    block_index -= INODE_DIRECT_BLOCK;
-    if (block_index < INODE_INDIRECT1_BLOCK){
-        int* block_id;
-        if(inode->indirect1_ptr == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            inode->indirect1_ptr = new_block_id;
-            put_inode(ino);
-            for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-                int* blockids = (int*)get_sector_of_block(inode->indirect1_ptr, i);
-                for(int j = 0; j < SECTOR_SIZE / 4; j++)
-                    blockids[j] = -1;
-                put_sector_of_block(inode->indirect1_ptr, i);
+    }
+    drop_inode(ino);
+
+    // each level of indirection covers INODE_INDIRECT(level-1) blocks per entry
+    int span = depth == 3 ? INODE_INDIRECT2_BLOCK : (depth == 2 ? INODE_INDIRECT1_BLOCK : 1);
+    for(int level = depth; level > 0 && block_id != -1; level--){
+        block_id = indirect_lookup(ino, block_id, block_index / span, alloc, level > 1);
+        block_index %= span;
+        span /= INODE_INDIRECT1_BLOCK;
+    }
+    return block_id;
+}
+
+static void bitmap_load(bitmap_t* map, uint64_t begin_sector, uint32_t group_sectors, uint32_t sectors, uint32_t max_bits){
+    // already hold the fs_lock
+    free(map->free_bits);
+    map->begin_sector = begin_sector;
+    map->group_sectors = group_sectors;
+    map->sectors = sectors;
+    map->max_bits = max_bits;
+    map->cursor = 0;
+    map->free_bits = (int*)malloc(sectors * sizeof(int));
+    assert(map->free_bits != NULL);
+    for(uint32_t i = 0; i < sectors; i++)
+        map->free_bits[i] = -1;
+}
+
+static void bitmap_unload(bitmap_t* map){
+    free(map->free_bits);
+    map->free_bits = NULL;
+}
+
+static void load_bitmaps(){
+    // already hold the fs_lock
+    // one bit per block or inode, numbered across the groups, a shorter last group has a shorter blockmap slice
+    uint32_t block_sectors = (now_superblock->block_max_num + SECTOR_BIT_SIZE - 1) / SECTOR_BIT_SIZE;
+    bitmap_load(&block_bitmap, group_sector(0), GROUP_BLOCKMAP_SECTORS, block_sectors, now_superblock->block_max_num);
+    bitmap_load(&inode_bitmap, group_sector(0) + GROUP_INODEMAP_SECTOR, GROUP_INODEMAP_SECTORS, now_superblock->group_num, now_superblock->inode_max_num);
+}
+
+static uint64_t bitmap_sector(bitmap_t* map, uint32_t index){
+    return map->begin_sector + (uint64_t)(index / map->group_sectors) * GROUP_SECTORS + index % map->group_sectors;
+}
+
+static int bitmap_free_bits(bitmap_t* map, uint32_t index){
+    // already hold the fs_lock
+    // counted the first time the sector is looked at, then kept up to date by bitmap_alloc and bitmap_clear
+    if(map->free_bits[index] < 0){
+        uint64_t sector = bitmap_sector(map, index);
+        uint64_t* words = (uint64_t*)sector_read(sector);
+        int used = 0;
+        for(int w = 0; w < SECTOR_BIT_WORDS; w++)
+            used += __builtin_popcountll(words[w]);
+        sector_drop(sector);
+        // the bits past max_bits are never set
+        int64_t bits = (int64_t)map->max_bits - (int64_t)index * SECTOR_BIT_SIZE;
+        bits = bits < 0 ? 0 : (bits > SECTOR_BIT_SIZE ? SECTOR_BIT_SIZE : bits);
+        map->free_bits[index] = bits - used;
+    }
+    return map->free_bits[index];
+}
+
+static int bitmap_alloc(bitmap_t* map, uint32_t goal){
+    // already hold the fs_lock
+    // first free bit from goal on, next fit from the cursor if goal is out of range,
+    // sectors with no free bit are skipped without being read,
+    // the sector of goal is visited again at the end for the words before it
+    if(goal >= map->max_bits)
+        goal = map->cursor;
+    uint32_t index = goal / SECTOR_BIT_SIZE;
+    int word = (goal % SECTOR_BIT_SIZE) / 64;
+    for(uint32_t n = 0; n <= map->sectors; n++){
+        if(bitmap_free_bits(map, index) > 0){
+            uint64_t sector = bitmap_sector(map, index);
+            uint64_t* words = (uint64_t*)sector_read(sector);
+            for(int w = word; w < SECTOR_BIT_WORDS; w++){
+                if(words[w] == ~0ULL)
+                    continue;
+                uint32_t bit = index * SECTOR_BIT_SIZE + w * 64 + __builtin_ctzll(~words[w]);
+                if(bit >= map->max_bits)
+                    break;
+                words[w] |= 1ULL << (bit % 64);
+                sector_put(sector);
+                sector_drop(sector);
+                map->free_bits[index]--;
+                map->cursor = bit + 1 < map->max_bits ? bit + 1 : 0;
+                return bit;
             }
+            sector_drop(sector);
         }
-        
-        int sector = block_index/ (SECTOR_SIZE / 4);
-        int* blockids = (int*)get_sector_of_block(inode->indirect1_ptr, sector);
-        block_id = &blockids[block_index % (SECTOR_SIZE / 4)];
-        if(*block_id == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            *block_id = new_block_id;
-            put_sector_of_block(inode->indirect1_ptr, sector);
-        }
-        return *block_id;
+        word = 0;
+        index = index + 1 < map->sectors ? index + 1 : 0;
     }
+    return -1;
+}
 
-    block_index -= INODE_INDIRECT1_BLOCK;
-    if (block_index < INODE_INDIRECT2_BLOCK){
-        int *block_id;
+static void bitmap_clear(bitmap_t* map, uint32_t bit){
+    // already hold the fs_lock
+    uint32_t index = bit / SECTOR_BIT_SIZE;
+    uint64_t sector = bitmap_sector(map, index);
+    uint64_t* words = (uint64_t*)sector_read(sector);
+    words[(bit % SECTOR_BIT_SIZE) / 64] &= ~(1ULL << (bit % 64));
+    sector_put(sector);
+    sector_drop(sector);
+    if(map->free_bits[index] >= 0)
+        map->free_bits[index]++;
+}
 
-        if(inode->indirect2_ptr == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            inode->indirect2_ptr = new_block_id;
-            put_inode(ino);
-            for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-                int* blockids = (int*)get_sector_of_block(inode->indirect2_ptr, i);
-                for(int j = 0; j < SECTOR_SIZE / 4; j++)
-                    blockids[j] = -1;
-                put_sector_of_block(inode->indirect2_ptr, i);
-            }
+static void bitmap_set_range(bitmap_t* map, uint32_t start, uint32_t len, int set){
+    // already hold the fs_lock
+    // the bits must all be in the other state, each bitmap sector is read once and covered words are set whole
+    uint32_t end = start + len;
+    while(start < end){
+        uint32_t index = start / SECTOR_BIT_SIZE;
+        uint32_t stop = (index + 1) * SECTOR_BIT_SIZE;
+        if(stop > end)
+            stop = end;
+        uint64_t sector = bitmap_sector(map, index);
+        uint64_t* words = (uint64_t*)sector_read(sector);
+        for(uint32_t bit = start; bit < stop; ){
+            uint32_t n = 64 - bit % 64;
+            if(n > stop - bit)
+                n = stop - bit;
+            uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << (bit % 64);
+            if(set)
+                words[(bit % SECTOR_BIT_SIZE) / 64] |= mask;
+            else
+                words[(bit % SECTOR_BIT_SIZE) / 64] &= ~mask;
+            bit += n;
         }
+        sector_put(sector);
+        sector_drop(sector);
+        if(map->free_bits[index] >= 0)
+            map->free_bits[index] += set ? -(int)(stop - start) : (int)(stop - start);
+        start = stop;
+    }
+}
 
-        int sector = (block_index / INODE_INDIRECT1_BLOCK) / (SECTOR_SIZE / 4);
-        int* blockids = (int*)get_sector_of_block(inode->indirect2_ptr, sector);
-        block_id = &blockids[(block_index / INODE_INDIRECT1_BLOCK) % (SECTOR_SIZE / 4)];
-        int block_id1 = *block_id;
-        if(*block_id == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            *block_id = new_block_id;
-            block_id1 = new_block_id;
-            put_sector_of_block(inode->indirect2_ptr, sector);
-            for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-                blockids = (int*)get_sector_of_block(block_id1, i);
-                for(int j = 0; j < SECTOR_SIZE / 4; j++)
-                    blockids[j] = -1;
-                put_sector_of_block(block_id1, i);
+static int bitmap_scan_run(const uint64_t* words, uint32_t base, int from, int min, int max, uint32_t* run_start, int* run_len){
+    // go on with the run of free bits in run_start and run_len over one bitmap sector from bit from,
+    // 1 once a run of at least min bits ends or reaches max bits, 0 if the sector ends first
+    for(int bit = from; bit < SECTOR_BIT_SIZE; ){
+        uint64_t rest = words[bit / 64] >> (bit % 64); // 1 = used
+        int left = 64 - bit % 64;
+        if(rest & 1){
+            if(*run_len >= min)
+                return 1;
+            *run_len = 0;
+            int used = ~rest == 0 ? 64 : __builtin_ctzll(~rest);
+            bit += used < left ? used : left;
+        } else {
+            int free = rest == 0 ? left : __builtin_ctzll(rest);
+            if(*run_len == 0)
+                *run_start = base + bit;
+            *run_len += free;
+            bit += free;
+            if(*run_len >= max){
+                *run_len = max;
+                return 1;
             }
         }
+    }
+    return 0;
+}
 
-        block_index %= INODE_INDIRECT1_BLOCK;
-        sector = block_index / (SECTOR_SIZE / 4);
-        blockids = (int*)get_sector_of_block(block_id1, sector);
-        block_id = &blockids[block_index % (SECTOR_SIZE / 4)];
-        if(*block_id == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            *block_id = new_block_id;
-            put_sector_of_block(block_id1, sector);
+static int bitmap_alloc_run(bitmap_t* map, uint32_t goal, int min, int max, int* len){
+    // already hold the fs_lock
+    // first fit of a run of at least min free bits from goal (the cursor if out of range) on, up to max bits,
+    // a run may go on into the next bitmap sector but does not wrap around the end of the map
+    if(goal >= map->max_bits)
+        goal = map->cursor;
+    uint32_t index = goal / SECTOR_BIT_SIZE;
+    int from = goal % SECTOR_BIT_SIZE;
+    uint32_t run_start = 0;
+    int run_len = 0;
+    int found = 0;
+    for(uint32_t n = 0; n <= map->sectors && !found; n++){
+        if(bitmap_free_bits(map, index) == 0){
+            // a full sector ends the run
+            found = run_len >= min;
+            if(!found)
+                run_len = 0;
+        } else {
+            uint64_t sector = bitmap_sector(map, index);
+            uint64_t* words = (uint64_t*)sector_read(sector);
+            found = bitmap_scan_run(words, index * SECTOR_BIT_SIZE, from, min, max, &run_start, &run_len);
+            sector_drop(sector);
         }
-        return *block_id;
+        if(index + 1 == map->sectors){
+            // the bits past max_bits look free, a run ends there
+            if(run_len > 0 && run_start + run_len > map->max_bits)
+                run_len = map->max_bits > run_start ? map->max_bits - run_start : 0;
+            found = run_len >= min;
+            if(!found)
+                run_len = 0;
+        }
+        from = 0;
+        index = index + 1 < map->sectors ? index + 1 : 0;
     }
+    if(!found)
+        return -1;
+    bitmap_set_range(map, run_start, run_len, 1);
+    map->cursor = run_start + run_len < map->max_bits ? run_start + run_len : 0;
+    *len = run_len;
+    return run_start;
+}
 
-    block_index -= INODE_INDIRECT2_BLOCK;
-    if (block_index < INODE_INDIRECT3_BLOCK){
-        int *block_id;
+static uint64_t group_sector(int group){
+    return now_superblock->block_table_begin_sector + (uint64_t)group * GROUP_SECTORS;
+}
 
-        if(inode->indirect3_ptr == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            inode->indirect3_ptr = new_block_id;
-            put_inode(ino);
-            for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-                int* blockids = (int*)get_sector_of_block(inode->indirect3_ptr, i);
-                for(int j = 0; j < SECTOR_SIZE / 4; j++)
-                    blockids[j] = -1;
-                put_sector_of_block(inode->indirect3_ptr, i);
-            }
-        }
-        
-        int sector = (block_index / INODE_INDIRECT2_BLOCK) / (SECTOR_SIZE / 4);
-        int* blockids = (int*)get_sector_of_block(inode->indirect3_ptr, sector);
-        block_id = &blockids[(block_index / INODE_INDIRECT2_BLOCK) % (SECTOR_SIZE / 4)];
-        int block_id1 = *block_id;
-        if(*block_id == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            *block_id = new_block_id;
-            block_id1 = new_block_id;
-            put_sector_of_block(inode->indirect3_ptr, sector);
-            for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-                blockids = (int*)get_sector_of_block(block_id1, i);
-                for(int j = 0; j < SECTOR_SIZE / 4; j++)
-                    blockids[j] = -1;
-                put_sector_of_block(block_id1, i);
-            }
-        }
+static groupdesc_t* get_groupdesc(int group){
+    //already hold the fs_lock
+    groupdesc_t* descs = (groupdesc_t*)sector_read(now_superblock->groupdesc_begin_sector + group / GROUPDESCS_IN_SECTOR);
+    return &descs[group % GROUPDESCS_IN_SECTOR];
+}
 
-        block_index %= INODE_INDIRECT2_BLOCK;
-        sector  = (block_index / INODE_INDIRECT1_BLOCK) / (SECTOR_SIZE / 4);
-        blockids = (int*)get_sector_of_block(block_id1, sector);
-        block_id = &blockids[(block_index / INODE_INDIRECT1_BLOCK)% (SECTOR_SIZE / 4)];
-        int block_id2 = *block_id;
-        if(*block_id == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            *block_id = new_block_id;
-            block_id2 = new_block_id;
-            put_sector_of_block(block_id1, sector);
-            for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-                blockids = (int*)get_sector_of_block(block_id2, i);
-                for(int j = 0; j < SECTOR_SIZE / 4; j++)
-                    blockids[j] = -1;
-                put_sector_of_block(block_id2, i);
-            }
-        }
+static void put_groupdesc(int group){
+    //already hold the fs_lock
+    sector_put(now_superblock->groupdesc_begin_sector + group / GROUPDESCS_IN_SECTOR);
+}
 
-        block_index %= INODE_INDIRECT1_BLOCK;
-        sector = block_index / (SECTOR_SIZE / 4);
-        blockids = (int*)get_sector_of_block(block_id2, sector);
-        int* block_id3 = &blockids[block_index % (SECTOR_SIZE / 4)];
-        if(*block_id3 == -1){
-            if(!alloc)
-                return -1;
-            int new_block_id = alloc_block();
-            if(new_block_id == -1)
-                return -1;
-            *block_id3 = new_block_id;
-            put_sector_of_block(block_id2, sector);
+static void drop_groupdesc(int group){
+    //already hold the fs_lock
+    sector_drop(now_superblock->groupdesc_begin_sector + group / GROUPDESCS_IN_SECTOR);
+}
+
+static void group_account_blocks(int block_id, int len, int release){
+    // already hold the fs_lock
+    // the free block counts of the groups [block_id, block_id + len) falls in
+    while(len > 0){
+        int group = block_id / GROUP_BLOCKS;
+        int n = (group + 1) * GROUP_BLOCKS - block_id;
+        if(n > len)
+            n = len;
+        groupdesc_t* desc = get_groupdesc(group);
+        desc->free_blocks += release ? n : -n;
+        put_groupdesc(group);
+        drop_groupdesc(group);
+        block_id += n;
+        len -= n;
+    }
+}
+
+static int group_fits(int group, int need_blocks){
+    // already hold the fs_lock
+    groupdesc_t* desc = get_groupdesc(group);
+    int ret = desc->free_inodes > 0 && (!need_blocks || desc->free_blocks > 0);
+    drop_groupdesc(group);
+    return ret;
+}
+
+static int find_group_dir(){
+    // already hold the fs_lock
+    // the group with the most free blocks among those with at least the average free inodes,
+    // directories spread over the device and leave room for their files next to them
+    int group_num = now_superblock->group_num;
+    uint32_t avg_inodes = (now_superblock->inode_max_num - now_superblock->inode_num) / group_num;
+    int best = -1;
+    uint32_t best_blocks = 0;
+    for(int group = 0; group < group_num; group++){
+        groupdesc_t* desc = get_groupdesc(group);
+        if(desc->free_inodes > 0 && desc->free_inodes >= avg_inodes && (best == -1 || desc->free_blocks > best_blocks)){
+            best = group;
+            best_blocks = desc->free_blocks;
         }
-        return *block_id3;
+        drop_groupdesc(group);
+    }
+    return best;
+}
+
+static int find_group_other(int parent_group){
+    // already hold the fs_lock
+    // the group of the parent directory, else one with free inodes and blocks probed at growing steps
+    // from there, else any with free inodes
+    int group_num = now_superblock->group_num;
+    int group = parent_group;
+    if(group_fits(group, 1))
+        return group;
+    for(int step = 1; step < group_num; step <<= 1){
+        group = (group + step) % group_num;
+        if(group_fits(group, 1))
+            return group;
+    }
+    for(int i = 1; i <= group_num; i++){
+        group = (parent_group + i) % group_num;
+        if(group_fits(group, 0))
+            return group;
     }
     return -1;
 }
 
-static int alloc_inode(){
+static int inode_goal(int ino){
+    // the first data block of the group of the inode
+    return ino / GROUP_INODES * GROUP_BLOCKS + GROUP_META_BLOCKS;
+}
+
+static int alloc_inode(int parent_ino, int dir){
     // already hold the fs_lock
-    int max_ino = now_superblock->inode_max_num;
-    if(now_superblock->inode_num >= max_ino){
+    // the root goes to group 0, see find_group_dir and find_group_other for the others
+    if(now_superblock->inode_num >= now_superblock->inode_max_num){
         return -1;
     }
-    int sector_begin = now_superblock->inodemap_begin_sector;
-    int sector_end = now_superblock->inodemap_begin_sector + now_superblock->inodemap_occupied_sectors;
-    int ino = 0;
-
-    for(int sector = sector_begin; sector < sector_end && ino < max_ino; sector++){
-        uint16_t* inodemap = (uint16_t*)sector_read(sector);
-        for(int index = 0; index < (SECTOR_BIT_SIZE / 16) && ino < max_ino; index++){
-            uint16_t* now_map = &inodemap[index];
-            for(int i = 0; i < 16 && ino < max_ino; i++){
-                uint16_t mask = 1 << i;
-                if((*now_map & mask) == 0){
-                    *now_map |= mask;
-                    sector_put(sector);
-                    now_superblock->inode_num++;
-                    sector_put(now_superblock->superblock_sector);
-                    return ino;
-                }
-                ino++;
-            }
-        }
+    int group = parent_ino < 0 ? 0 : (dir ? find_group_dir() : find_group_other(parent_ino / GROUP_INODES));
+    if(group == -1)
+        return -1;
+    int ino = bitmap_alloc(&inode_bitmap, group * GROUP_INODES);
+    if(ino != -1){
+        now_superblock->inode_num++;
+        sector_put(now_superblock->superblock_sector);
+        groupdesc_t* desc = get_groupdesc(ino / GROUP_INODES);
+        desc->free_inodes--;
+        desc->dir_num += dir;
+        put_groupdesc(ino / GROUP_INODES);
+        drop_groupdesc(ino / GROUP_INODES);
     }
-
-    return -1;
+    return ino;
 }
 
 static int release_inode(int ino){
@@ -349,94 +654,573 @@ static int release_inode(int ino){
     if(ino >= now_superblock->inode_max_num || ino < 0){
         return 0;
     }
+    delalloc_discard(ino, 0);
+    prealloc_t* pa = prealloc_find(ino, 0);
+    if(pa != NULL)
+        prealloc_discard(pa);
     inode_t* inode = (inode_t*)get_inode(ino);
-    for(int i = 0; i < INODE_DIRECT_BLOCK; i++){
-        release_block_recursive(inode->block_ptr[i], 0);
-        inode->block_ptr[i] = -1;
-    }
-    release_block_recursive(inode->indirect1_ptr, 1);
-    inode->indirect1_ptr = -1;
-    release_block_recursive(inode->indirect2_ptr, 2);
-    inode->indirect2_ptr = -1;
-    release_block_recursive(inode->indirect3_ptr, 3);
-    inode->indirect3_ptr = -1;
-    put_inode(ino);
-    int sector = now_superblock->inodemap_begin_sector + (ino / SECTOR_BIT_SIZE);
-    uint16_t* inodemap = (uint16_t*)sector_read(sector);
-    inodemap[(ino % SECTOR_BIT_SIZE) / 16] &= ~(1 << (ino % 16));
-    sector_put(sector);
+    int dir = (inode->mode & S_DIR) != 0;
+    drop_inode(ino);
+    release_file_blocks(ino, 0);
+    bitmap_clear(&inode_bitmap, ino);
     now_superblock->inode_num--;
     sector_put(now_superblock->superblock_sector);
+    groupdesc_t* desc = get_groupdesc(ino / GROUP_INODES);
+    desc->free_inodes++;
+    desc->dir_num -= dir;
+    put_groupdesc(ino / GROUP_INODES);
+    drop_groupdesc(ino / GROUP_INODES);
     return 1;
 }
 
-static int alloc_block(){
+static int free_blocks(){
     // already hold the fs_lock
-    int max_id = now_superblock->block_max_num;
-    if(now_superblock->block_num >= max_id){
+    // blocks the allocators may hand out, those reserved for delayed allocation are not
+    return now_superblock->block_max_num - now_superblock->block_num - delalloc_num - delalloc_reserved;
+}
+
+static int alloc_block(int goal){
+    // already hold the fs_lock
+    // the first free block at or after goal, -1 for the cursor
+    if(free_blocks() <= 0)
+        prealloc_reclaim();
+    if(free_blocks() <= 0)
         return -1;
+    int block_id = bitmap_alloc(&block_bitmap, goal);
+    if(block_id != -1){
+        now_superblock->block_num++;
+        sector_put(now_superblock->superblock_sector);
+        group_account_blocks(block_id, 1, 0);
     }
-    int sector_begin = now_superblock->blockmap_begin_sector;
-    int sector_end = now_superblock->blockmap_begin_sector + now_superblock->blockmap_occupied_sectors;
-    int block_id = 0;
-
-    for(int sector = sector_begin; sector < sector_end && block_id < max_id; sector++){
-        uint16_t* blockmap = (uint16_t*)sector_read(sector);
-        for(int index = 0; index < (SECTOR_BIT_SIZE / 16) && block_id < max_id; index++){
-            uint16_t* now_map = &blockmap[index];
-            for(int i = 0; i < 16 && block_id < max_id; i++){
-                uint16_t mask = 1 << i;
-                if((*now_map & mask) == 0){
-                    *now_map |= mask;
-                    sector_put(sector);
-                    now_superblock->block_num++;
-                    sector_put(now_superblock->superblock_sector);
-                    return block_id;
-                }
-                block_id++;
+    return block_id;
+}
+
+static int alloc_blocks(int goal, int min, int max, int* len){
+    // already hold the fs_lock
+    // a contiguous run of min to max free blocks, the first fit at or after goal (-1 for the cursor)
+    if(free_blocks() < min)
+        prealloc_reclaim();
+    int free_num = free_blocks();
+    if(max > free_num)
+        max = free_num;
+    if(min > max || min <= 0)
+        return -1;
+    int block_id = bitmap_alloc_run(&block_bitmap, goal, min, max, len);
+    if(block_id != -1){
+        now_superblock->block_num += *len;
+        sector_put(now_superblock->superblock_sector);
+        group_account_blocks(block_id, *len, 0);
+    }
+    return block_id;
+}
+
+static void release_blocks(int block_id, int len){
+    // already hold the fs_lock
+    if(block_id == -1 || len <= 0)
+        return;
+    bitmap_set_range(&block_bitmap, block_id, len, 0);
+    now_superblock->block_num -= len;
+    sector_put(now_superblock->superblock_sector);
+    group_account_blocks(block_id, len, 1);
+}
+
+static prealloc_t* prealloc_find(int ino, int create){
+    // already hold the fs_lock
+    prealloc_t* victim = NULL;
+    for(int i = 0; i < PREALLOC_SLOTS; i++){
+        if(preallocs[i].ino == ino)
+            return &preallocs[i];
+        if(victim == NULL && preallocs[i].ino == -1)
+            victim = &preallocs[i];
+    }
+    if(!create)
+        return NULL;
+    if(victim == NULL){
+        // all slots in use, take them in turn
+        victim = &preallocs[prealloc_clock];
+        prealloc_clock = (prealloc_clock + 1) % PREALLOC_SLOTS;
+        prealloc_discard(victim);
+    }
+    victim->ino = ino;
+    victim->next = victim->end = -1;
+    victim->window = PREALLOC_MIN_WINDOW;
+    victim->want = 0;
+    return victim;
+}
+
+static void prealloc_discard(prealloc_t* pa){
+    // already hold the fs_lock
+    // the blocks not handed out go back to the bitmap
+    if(pa->ino == -1)
+        return;
+    if(pa->next != -1)
+        release_blocks(pa->next, pa->end - pa->next);
+    pa->ino = -1;
+}
+
+static int prealloc_reclaim(){
+    // already hold the fs_lock
+    // the device ran out of space: the unused blocks of every window go back, a window refills after its last block
+    int reclaimed = 0;
+    for(int i = 0; i < PREALLOC_SLOTS; i++){
+        prealloc_t* pa = &preallocs[i];
+        if(pa->ino == -1 || pa->next == pa->end)
+            continue;
+        release_blocks(pa->next, pa->end - pa->next);
+        reclaimed += pa->end - pa->next;
+        pa->next = pa->end;
+    }
+    return reclaimed;
+}
+
+static int prealloc_held(){
+    // already hold the fs_lock
+    // blocks marked used in the bitmap but not handed out yet
+    int held = 0;
+    for(int i = 0; i < PREALLOC_SLOTS; i++)
+        if(preallocs[i].ino != -1)
+            held += preallocs[i].end - preallocs[i].next;
+    return held;
+}
+
+static prealloc_t* prealloc_start(int ino, int block_index, int want){
+    // already hold the fs_lock
+    // the window for want blocks from block_index on, the first one right after the block before them
+    prealloc_t* pa = prealloc_find(ino, 1);
+    pa->want = want;
+    if(pa->end == -1 && block_index > 0){
+        int last = inode_mapto_block(ino, block_index - 1, 0);
+        if(last != -1)
+            pa->next = pa->end = last + 1;
+    }
+    return pa;
+}
+
+static int alloc_file_block(int ino){
+    // already hold the fs_lock
+    // from the window of the inode while it is being written, it is refilled right after its last block if free,
+    // the first one in the group of the inode
+    prealloc_t* pa = prealloc_find(ino, 0);
+    if(pa == NULL)
+        return alloc_block(inode_goal(ino));
+    if(pa->next == pa->end){
+        int size = pa->want > pa->window ? pa->want : pa->window;
+        if(size > PREALLOC_MAX_WINDOW)
+            size = PREALLOC_MAX_WINDOW;
+        // the last free blocks are left to the other files
+        int room = free_blocks() - PREALLOC_RESERVE;
+        if(size > room)
+            size = room > 1 ? room : 1;
+        int len;
+        int goal = pa->end == -1 ? inode_goal(ino) : pa->end;
+        int block_id = alloc_blocks(goal, size, size, &len);
+        if(block_id == -1)
+            block_id = alloc_blocks(goal, 1, size, &len);
+        if(block_id == -1)
+            return -1;
+        pa->next = block_id;
+        pa->end = block_id + len;
+        if(pa->window < PREALLOC_MAX_WINDOW)
+            pa->window *= 2;
+    }
+    if(pa->want > 0)
+        pa->want--;
+    return pa->next++;
+}
+
+static delalloc_block_t** delalloc_bucket(int ino, int block_index){
+    return &delalloc_hash[((uint32_t)ino * 0x9E3779B1u + block_index) & (DELALLOC_HASH - 1)];
+}
+
+static delalloc_block_t* delalloc_lookup(int ino, int block_index){
+    // already hold the fs_lock
+    for(delalloc_block_t* block = *delalloc_bucket(ino, block_index); block != NULL; block = block->hash_next)
+        if(block->ino == ino && block->block_index == block_index)
+            return block;
+    return NULL;
+}
+
+static delalloc_block_t* delalloc_get(int ino, int block_index){
+    // already hold the fs_lock
+    // the delayed block, a new zeroed one if delayed allocation is on, the block is a hole and the space
+    // can be reserved, else NULL and the block is mapped now
+    delalloc_block_t* block = delalloc_num > 0 ? delalloc_lookup(ino, block_index) : NULL;
+    if(block != NULL || !delalloc_enabled || inode_mapto_block(ino, block_index, 0) != -1)
+        return block;
+    if(delalloc_num >= DELALLOC_MAX_BLOCKS)
+        delalloc_flush(1);
+
+    delalloc_inode_t *di = NULL, *unused = NULL, *oldest = NULL;
+    for(int i = 0; i < DELALLOC_INODES && di == NULL; i++){
+        delalloc_inode_t* slot = &delalloc_inodes[i];
+        if(slot->ino == ino)
+            di = slot;
+        else if(slot->ino == -1)
+            unused = unused == NULL ? slot : unused;
+        else if(oldest == NULL || slot->since < oldest->since)
+            oldest = slot;
+    }
+    if(di == NULL && unused == NULL){
+        delalloc_flush_inode(oldest);
+        if(oldest->ino != -1)
+            return NULL;
+        unused = oldest;
+    }
+
+    // counted as used, with the indirect blocks the inode may need for it
+    int first = di == NULL || block_index < di->first ? block_index : di->first;
+    int last = di == NULL || block_index > di->last ? block_index : di->last;
+    int reserve = delalloc_indirect(first, last);
+    int depths = (di == NULL ? 0 : di->depths) + block_depth(block_index);
+    if(reserve > depths)
+        reserve = depths;
+    int need = 1 + reserve - (di == NULL ? 0 : di->reserve);
+    if(free_blocks() < need)
+        prealloc_reclaim();
+    if(free_blocks() < need)
+        return NULL;
+
+    if(di == NULL){
+        di = unused;
+        di->ino = ino;
+        di->num = 0;
+        di->since = time(NULL);
+        di->blocks = NULL;
+        di->depths = 0;
+        di->reserve = 0;
+    }
+    block = (delalloc_block_t*)calloc(1, sizeof(delalloc_block_t));
+    assert(block != NULL);
+    block->ino = ino;
+    block->block_index = block_index;
+    delalloc_block_t** bucket = delalloc_bucket(ino, block_index);
+    block->hash_next = *bucket;
+    *bucket = block;
+    delalloc_link(di, block);
+    delalloc_account(di);
+    return block;
+}
+
+static int block_depth(int block_index){
+    // levels of indirect blocks above a block of a file
+    if(block_index < INODE_DIRECT_BLOCK)
+        return 0;
+    if((block_index -= INODE_DIRECT_BLOCK) < INODE_INDIRECT1_BLOCK)
+        return 1;
+    if((block_index -= INODE_INDIRECT1_BLOCK) < INODE_INDIRECT2_BLOCK)
+        return 2;
+    return 3;
+}
+
+static int delalloc_indirect(int first, int last){
+    // the most indirect blocks mapping the block indexes from first to last can take: each root the range
+    // reaches, and below it one block per INODE_INDIRECT1_BLOCK, INODE_INDIRECT2_BLOCK... entries of the range
+    int spans[3] = {INODE_INDIRECT1_BLOCK, INODE_INDIRECT2_BLOCK, INODE_INDIRECT3_BLOCK};
+    int base = INODE_DIRECT_BLOCK;
+    int num = 0;
+    for(int depth = 1; depth <= 3; depth++){
+        int span = spans[depth - 1];
+        if(last >= base && first - base < span){
+            int lo = first > base ? first - base : 0;
+            int hi = last - base < span ? last - base : span - 1;
+            num++;
+            for(int level = 1, level_span = INODE_INDIRECT1_BLOCK; level < depth; level++, level_span *= INODE_INDIRECT1_BLOCK)
+                num += hi / level_span - lo / level_span + 1;
+        }
+        base += span;
+    }
+    return num;
+}
+
+static void delalloc_link(delalloc_inode_t* di, delalloc_block_t* block){
+    // already hold the fs_lock
+    if(di->num == 0 || block->block_index < di->first)
+        di->first = block->block_index;
+    if(di->num == 0 || block->block_index > di->last)
+        di->last = block->block_index;
+    di->depths += block_depth(block->block_index);
+    block->next = di->blocks;
+    di->blocks = block;
+    di->num++;
+    delalloc_num++;
+}
+
+static void delalloc_account(delalloc_inode_t* di){
+    // already hold the fs_lock
+    // the indirect blocks the delayed blocks of di may need, the smaller of two upper bounds
+    int reserve = 0;
+    if(di->num > 0){
+        reserve = delalloc_indirect(di->first, di->last);
+        if(reserve > di->depths)
+            reserve = di->depths;
+    }
+    delalloc_reserved += reserve - di->reserve;
+    di->reserve = reserve;
+}
+
+static int delalloc_block_cmp(const void* a, const void* b){
+    int x = (*(delalloc_block_t* const*)a)->block_index, y = (*(delalloc_block_t* const*)b)->block_index;
+    return x < y ? -1 : x > y;
+}
+
+static void delalloc_unhash(delalloc_block_t* block){
+    // already hold the fs_lock
+    delalloc_block_t** p = delalloc_bucket(block->ino, block->block_index);
+    while(*p != block)
+        p = &(*p)->hash_next;
+    *p = block->hash_next;
+}
+
+static void delalloc_flush_inode(delalloc_inode_t* di){
+    // already hold the fs_lock
+    // the blocks are mapped in file order out of a preallocation window sized to all of them,
+    // those finding no place stay delayed
+    int ino = di->ino;
+    int num = di->num;
+    delalloc_block_t** blocks = (delalloc_block_t**)malloc(num * sizeof(delalloc_block_t*));
+    assert(blocks != NULL);
+    int n = 0;
+    for(delalloc_block_t* block = di->blocks; block != NULL; block = block->next)
+        blocks[n++] = block;
+    qsort(blocks, num, sizeof(delalloc_block_t*), delalloc_block_cmp);
+    // the reservation turns into the allocation
+    delalloc_num -= num;
+    di->num = 0;
+    di->blocks = NULL;
+    di->depths = 0;
+    delalloc_account(di);
+    di->ino = -1;
+
+    prealloc_t* pa = prealloc_start(ino, blocks[0]->block_index, num);
+    int mapped;
+    for(mapped = 0; mapped < num; mapped++){
+        int block_id = inode_mapto_block(ino, blocks[mapped]->block_index, 1);
+        if(block_id == -1)
+            break;
+        delalloc_unhash(blocks[mapped]);
+        block_t* block = get_new_block(block_id, 0);
+        memcpy(block, &blocks[mapped]->data, BLOCK_SIZE);
+        put_block(block_id, 0, BLOCK_SIZE);
+        drop_block(block_id);
+        free(blocks[mapped]);
+    }
+    pa->want = 0;
+    if(!inode_is_open(ino))
+        prealloc_discard(pa);
+    if(mapped < num){
+        di->ino = ino;
+        for(int i = mapped; i < num; i++)
+            delalloc_link(di, blocks[i]);
+        delalloc_account(di);
+    }
+    free(blocks);
+}
+
+static void delalloc_flush(int all){
+    // already hold the fs_lock
+    // every inode with delayed blocks if all, else those delayed for DELALLOC_EXPIRE seconds
+    uint32_t now = time(NULL);
+    for(int i = 0; i < DELALLOC_INODES; i++)
+        if(delalloc_inodes[i].ino != -1 && (all || now - delalloc_inodes[i].since >= DELALLOC_EXPIRE))
+            delalloc_flush_inode(&delalloc_inodes[i]);
+}
+
+static void delalloc_discard(int ino, int from){
+    // already hold the fs_lock
+    // the delayed blocks of ino from block index from on go away before they ever got a place on the device
+    for(int i = 0; i < DELALLOC_INODES; i++){
+        delalloc_inode_t* di = &delalloc_inodes[i];
+        if(di->ino != ino)
+            continue;
+        delalloc_block_t** p = &di->blocks;
+        while(*p != NULL){
+            delalloc_block_t* block = *p;
+            if(block->block_index < from){
+                p = &block->next;
+                continue;
             }
+            *p = block->next;
+            delalloc_unhash(block);
+            free(block);
+            di->num--;
+            delalloc_num--;
+        }
+        // the bounds of the blocks left
+        di->depths = 0;
+        for(delalloc_block_t* block = di->blocks; block != NULL; block = block->next){
+            if(block == di->blocks || block->block_index < di->first)
+                di->first = block->block_index;
+            if(block == di->blocks || block->block_index > di->last)
+                di->last = block->block_index;
+            di->depths += block_depth(block->block_index);
         }
+        delalloc_account(di);
+        if(di->num == 0)
+            di->ino = -1;
     }
+}
 
-    return -1;
+static void delalloc_flush_hook(int all){
+    // the flusher and cache_flush call in without the fs_lock,
+    // init_superblock calls cache_flush with it held but with nothing delayed
+    if(__atomic_load_n(&delalloc_num, __ATOMIC_RELAXED) == 0)
+        return;
+    acquire(&fs_lock);
+    if(now_superblock != NULL)
+        delalloc_flush(all);
+    release(&fs_lock);
 }
 
-static int release_block(int block_id){
+static void release_batch_run(release_batch_t* batch){
     // already hold the fs_lock
-    if(block_id == -1)
-        return 0;
-    int sector = now_superblock->blockmap_begin_sector + (block_id / SECTOR_BIT_SIZE);
-    uint16_t* blockmap = (uint16_t*)sector_read(sector);
-    blockmap[(block_id % SECTOR_BIT_SIZE) / 16] &= ~(1 << (block_id % 16));
-    sector_put(sector);
-    now_superblock->block_num--;
+    if(batch->len == 0)
+        return;
+    bitmap_set_range(&block_bitmap, batch->start, batch->len, 0);
+    group_account_blocks(batch->start, batch->len, 1);
+    batch->len = 0;
+}
+
+static void release_batch_add(release_batch_t* batch, int block_id){
+    // already hold the fs_lock
+    // adjacent blocks are cleared as one run
+    if(batch->len > 0 && block_id == batch->start + batch->len){
+        batch->len++;
+    } else {
+        release_batch_run(batch);
+        batch->start = block_id;
+        batch->len = 1;
+    }
+    batch->total++;
+}
+
+static void release_batch_end(release_batch_t* batch){
+    // already hold the fs_lock
+    release_batch_run(batch);
+    if(batch->total == 0)
+        return;
+    now_superblock->block_num -= batch->total;
     sector_put(now_superblock->superblock_sector);
-    block_id = -1;
-    return 1;
+    batch->total = 0;
 }
 
-static int release_block_recursive(int block_id, int depth){
+static int release_tree(release_batch_t* batch, int block_id, int depth, int from){
     // already hold the fs_lock
+    // the blocks under block_id from block index from on, 1 if block_id went too and its entry is to be cleared;
+    // a block going as a whole is released before its children and left as it is, so a file written in order
+    // goes back in a few runs and no freed indirect block is dirtied
     if(block_id == -1)
         return 0;
-    if(depth != 0)
-        for(int i = 0; i < SECTOR_IN_BLOCK; i++){
-            int* blockids = (int*)get_sector_of_block(block_id, i);
-            for(int j = 0; j < SECTOR_SIZE / 4; j++){
-                release_block_recursive(blockids[j], depth - 1);
-                blockids[j] = -1;
+    if(from == 0)
+        release_batch_add(batch, block_id);
+    if(depth == 0)
+        return from == 0;
+
+    int span = depth == 3 ? INODE_INDIRECT2_BLOCK : (depth == 2 ? INODE_INDIRECT1_BLOCK : 1);
+    int first = from / span;
+    int* blockids = (int*)get_block(block_id);
+    int changed_begin = INODE_INDIRECT1_BLOCK, changed_end = 0;
+    for(int i = first; i < INODE_INDIRECT1_BLOCK; i++){
+        if((i & 1) == 0){
+            // holes are passed over two entries at a time
+            uint64_t pair;
+            memcpy(&pair, &blockids[i], sizeof(pair));
+            if(pair == ~0ULL){
+                i++;
+                continue;
             }
-            put_sector_of_block(block_id, i);
         }
-    return release_block(block_id);
+        if(blockids[i] == -1)
+            continue;
+        int sub_from = i == first ? from % span : 0;
+        if(release_tree(batch, blockids[i], depth - 1, sub_from) && from != 0){
+            blockids[i] = -1;
+            if(i < changed_begin)
+                changed_begin = i;
+            changed_end = i + 1;
+        }
+    }
+    if(from == 0){
+        drop_block(block_id);
+        return 1;
+    }
+
+    // cut in the middle, the block goes too if nothing before the cut is left
+    int empty = 1;
+    for(int i = 0; i <= first && empty; i++)
+        empty = blockids[i] == -1;
+    if(!empty && changed_end > 0)
+        put_block(block_id, changed_begin * 4, (changed_end - changed_begin) * 4);
+    drop_block(block_id);
+    if(empty)
+        release_batch_add(batch, block_id);
+    return empty;
 }
 
+static void release_file_blocks(int ino, int keep){
+    // already hold the fs_lock
+    // the blocks of ino from block index keep on, the bitmaps and counters are updated once per run
+    release_batch_t batch = {0, 0, 0};
+    inode_t* inode = get_inode(ino);
+    for(int i = keep; i < INODE_DIRECT_BLOCK; i++)
+        if(release_tree(&batch, inode->block_ptr[i], 0, 0))
+            inode->block_ptr[i] = -1;
+    uint32_t* roots[3] = {&inode->indirect1_ptr, &inode->indirect2_ptr, &inode->indirect3_ptr};
+    int spans[3] = {INODE_INDIRECT1_BLOCK, INODE_INDIRECT2_BLOCK, INODE_INDIRECT3_BLOCK};
+    int base = INODE_DIRECT_BLOCK;
+    for(int depth = 1; depth <= 3; depth++){
+        int from = keep > base ? keep - base : 0;
+        if(from < spans[depth - 1] && release_tree(&batch, *roots[depth - 1], depth, from))
+            *roots[depth - 1] = -1;
+        base += spans[depth - 1];
+    }
+    put_inode(ino);
+    drop_inode(ino);
+    release_batch_end(&batch);
+}
+
+static void inode_resize(int ino, int size){
+    // already hold the fs_lock
+    // the blocks past a new end go back to the bitmap, an extension reads as a hole
+    inode_t* inode = get_inode(ino);
+    int old_size = inode->size;
+    inode->size = size;
+    put_inode(ino);
+    drop_inode(ino);
+    if(size >= old_size)
+        return;
+
+    int tail = size % BLOCK_SIZE;
+    int keep = size / BLOCK_SIZE + (tail != 0);
+    if(tail != 0){
+        // the rest of the last block is zeroed so that it reads as zeros once the file grows again
+        delalloc_block_t* delayed = delalloc_num > 0 ? delalloc_lookup(ino, keep - 1) : NULL;
+        int block_id;
+        if(delayed != NULL){
+            memset(delayed->data.data + tail, 0, BLOCK_SIZE - tail);
+        } else if((block_id = inode_mapto_block(ino, keep - 1, 0)) != -1){
+            char* block_buf = (char*)get_block(block_id);
+            memset(block_buf + tail, 0, BLOCK_SIZE - tail);
+            put_block(block_id, tail, BLOCK_SIZE - tail);
+            drop_block(block_id);
+        }
+    }
+    delalloc_discard(ino, keep);
+    prealloc_t* pa = prealloc_find(ino, 0);
+    if(pa != NULL)
+        prealloc_discard(pa);
+    release_file_blocks(ino, keep);
+}
+
+static uint64_t inode_sector(int ino){
+    // in the inode table of the group of ino
+    return group_sector(ino / GROUP_INODES) + GROUP_INODE_TABLE_SECTOR + (ino % GROUP_INODES) / INODES_IN_SECTOR;
+}
 
 static inode_t* get_inode(int ino){
     //already hold the fs_lock
     if(ino >= now_superblock->inode_max_num || ino < 0)
         return NULL;
-    int sector = now_superblock->inode_table_begin_sector + (ino / INODES_IN_SECTOR);
+    uint64_t sector = inode_sector(ino);
     inode_t* tmp_inode = (inode_t*)sector_read(sector);
     return &tmp_inode[ino % INODES_IN_SECTOR];
 }
@@ -445,32 +1229,46 @@ static int put_inode(int ino){
     //already hold the fs_lock
     if(ino >= now_superblock->inode_max_num || ino < 0)
         return 0;
-    int sector = now_superblock->inode_table_begin_sector + (ino / INODES_IN_SECTOR);
-    sector_put(sector);
+    sector_put(inode_sector(ino));
     return 1;
 }
 
-static sector_t* get_sector_of_block(int block_id, int sector_index){
+static void drop_inode(int ino){
+    //already hold the fs_lock
+    if(ino >= now_superblock->inode_max_num || ino < 0)
+        return;
+    sector_drop(inode_sector(ino));
+}
+
+static block_t* get_block(int block_id){
     //already hold the fs_lock
     if(block_id >= now_superblock->block_max_num || block_id < 0)
         return 0;
-    if(sector_index >= SECTOR_IN_BLOCK || sector_index < 0)
-        return 0;
-    int sector = now_superblock->block_table_begin_sector + (block_id * SECTOR_IN_BLOCK) + sector_index;
-    return sector_read(sector);
+    return block_read(GET_BLOCK(now_superblock->block_table_begin_sector) + block_id);
 }
 
-static int put_sector_of_block(int block_id, int sector_index){
+static block_t* get_new_block(int block_id, int zero){
     //already hold the fs_lock
     if(block_id >= now_superblock->block_max_num || block_id < 0)
         return 0;
-    if(sector_index >= SECTOR_IN_BLOCK || sector_index < 0)
+    return block_create(GET_BLOCK(now_superblock->block_table_begin_sector) + block_id, zero);
+}
+
+static int put_block(int block_id, uint32_t offset, uint32_t len){
+    //already hold the fs_lock
+    if(block_id >= now_superblock->block_max_num || block_id < 0)
         return 0;
-    int sector = now_superblock->block_table_begin_sector + (block_id * SECTOR_IN_BLOCK) + sector_index;
-    sector_put(sector);
+    block_dirty(GET_BLOCK(now_superblock->block_table_begin_sector) + block_id, offset, len);
     return 1;
 }
 
+static void drop_block(int block_id){
+    //already hold the fs_lock
+    if(block_id >= now_superblock->block_max_num || block_id < 0)
+        return;
+    block_drop(GET_BLOCK(now_superblock->block_table_begin_sector) + block_id);
+}
+
 static int set_dentry(int ino, char* name, dentry_t* dentry){
     //already hold the fs_lock
     dentry->inode_num = ino;
@@ -481,15 +1279,13 @@ static int set_dentry(int ino, char* name, dentry_t* dentry){
     return 1;
 }
 
-static void init_dentry_arr(dentry_t* dentry, int parent_ino, int self_ino, int first){
+static void init_dentry_arr(dentry_t* dentry, int parent_ino, int self_ino){
     //already hold the fs_lock
-    for(int i = 0; i < SECTOR_SIZE / DENTRY_SIZE; i++){
+    for(int i = 0; i < DENTRYS_IN_BLOCK; i++){
         set_dentry(-1, "", &dentry[i]);
     }
-    if(first){
-        set_dentry(self_ino, ".", &dentry[0]);
-        set_dentry(parent_ino, "..", &dentry[1]);
-    }
+    set_dentry(self_ino, ".", &dentry[0]);
+    set_dentry(parent_ino, "..", &dentry[1]);
 }
 
 
@@ -537,28 +1333,29 @@ static dentry_t* find_empty_dentry(dentry_t* dentrys, int dentry_num){
 static int parentino_to_childino(int parent_ino, char* name){
     //already hold the fs_lock
     inode_t* parent_inode = get_inode(parent_ino);
-    if((parent_inode->mode&S_DIR)==0) //parent is not a directory
+    if((parent_inode->mode&S_DIR)==0){ //parent is not a directory
+        drop_inode(parent_ino);
         return -1;
+    }
     int child_ino = -1;
     int count = 0;
-    for(int i = 0;; i++){
+    int done = 0;
+    for(int i = 0; !done; i++){
         int block_id = inode_mapto_block(parent_ino, i, 0);
         if(block_id == -1)
-            return -1;
-        for(int j = 0; j < SECTOR_IN_BLOCK; j++){
-            dentry_t* dentrys = (dentry_t*)get_sector_of_block(block_id, j);
-            dentry_t* child_dentry = find_dentry_byname(name, &count, dentrys, DENTRYS_IN_SECTOR);
-            if(child_dentry != NULL){
-                child_ino = child_dentry->inode_num;
-                if(child_ino != -1)
-                    return child_ino;
-                else
-                    assert(0);
-            }
-            if(count >= parent_inode->size)
-                return -1;
-        }
-    }
+            break;
+        dentry_t* dentrys = (dentry_t*)get_block(block_id);
+        dentry_t* child_dentry = find_dentry_byname(name, &count, dentrys, DENTRYS_IN_BLOCK);
+        if(child_dentry != NULL){
+            child_ino = child_dentry->inode_num;
+            assert(child_ino != -1);
+            done = 1;
+        } else if(count >= parent_inode->size)
+            done = 1;
+        drop_block(block_id);
+    }
+    drop_inode(parent_ino);
+    return child_ino;
 }
 
 static int walk_by_path(char* path, int origin_ino){
@@ -598,48 +1395,54 @@ static int add_dir(int parent_ino, char* name){
     //already hold the fs_lock
     inode_t* parent_inode = get_inode(parent_ino);
     dentry_t* new_dentry;
-    for(int i = 0;; i++){
+    int ret = -1;
+    for(int i = 0; ret == -1; i++){
         int block_id = inode_mapto_block(parent_ino, i, 1);
         assert(block_id != -1);
-        for(int j = 0; j < SECTOR_IN_BLOCK; j++){
-            dentry_t* dentrys = (dentry_t*)get_sector_of_block(block_id, j);
-            new_dentry = find_empty_dentry(dentrys, DENTRYS_IN_SECTOR);
-            if(new_dentry != NULL){
-                int new_ino = alloc_inode();
-                if(new_ino == -1)
-                    return 0;
+        dentry_t* dentrys = (dentry_t*)get_block(block_id);
+        new_dentry = find_empty_dentry(dentrys, DENTRYS_IN_BLOCK);
+        if(new_dentry != NULL){
+            int new_ino = alloc_inode(parent_ino, 1);
+            if(new_ino == -1)
+                ret = 0;
+            else{
                 set_dentry(new_ino, name, new_dentry);
                 init_inode(parent_ino, new_ino, 1);
                 parent_inode->size++;
                 put_inode(parent_ino);
-                put_sector_of_block(block_id, j);
-                return 1;
+                put_block(block_id, (new_dentry - dentrys) * DENTRY_SIZE, DENTRY_SIZE);
+                ret = 1;
             }
         }
+        drop_block(block_id);
     }
-    return 0;
+    drop_inode(parent_ino);
+    return ret;
 }
 
 static int del_dir(int parent_ino, char* name){
     //already hold the fs_lock
     inode_t* parent_inode = get_inode(parent_ino);
     int count = 0;
-    for(int i = 0;; i++){
+    int ret = -1;
+    for(int i = 0; ret == -1; i++){
         int block_id = inode_mapto_block(parent_ino, i, 0);
-        if(block_id == -1)
-            return 0;
-        for(int j = 0; j < SECTOR_IN_BLOCK; j++){
-            dentry_t* dentrys = (dentry_t*)get_sector_of_block(block_id, j);
-            dentry_t* child_dentry = find_dentry_byname(name, &count, dentrys, DENTRYS_IN_SECTOR);
-            if(child_dentry != NULL){
-                int child_ino = child_dentry->inode_num;
-                if(child_ino == now_superblock->root_ino || child_ino == now_ino)// root
-                    return -2;
-                inode_t* child_inode = get_inode(child_ino);
-                if((child_inode->mode & S_DIR) == 0) // not a directory
-                    return 0;
-                if(child_inode->nlinks == 1 && child_inode->size > 2) // not empty
-                    return -2;
+        if(block_id == -1){
+            ret = 0;
+            break;
+        }
+        dentry_t* dentrys = (dentry_t*)get_block(block_id);
+        dentry_t* child_dentry = find_dentry_byname(name, &count, dentrys, DENTRYS_IN_BLOCK);
+        if(child_dentry != NULL){
+            int child_ino = child_dentry->inode_num;
+            inode_t* child_inode = get_inode(child_ino);
+            if(child_ino == now_superblock->root_ino || child_ino == now_ino)// root
+                ret = -2;
+            else if((child_inode->mode & S_DIR) == 0) // not a directory
+                ret = 0;
+            else if(child_inode->nlinks == 1 && child_inode->size > 2) // not empty
+                ret = -2;
+            else{
                 child_inode->nlinks--;
                 if(child_inode->nlinks == 0) // no links left
                     release_inode(child_ino);
@@ -647,73 +1450,77 @@ static int del_dir(int parent_ino, char* name){
                     put_inode(child_ino);
                 set_dentry(-1, "", child_dentry);
                 parent_inode->size--;
-                put_sector_of_block(block_id, j);
+                put_block(block_id, (child_dentry - dentrys) * DENTRY_SIZE, DENTRY_SIZE);
                 put_inode(parent_ino);
-                return 1;
+                ret = 1;
             }
-            if(count == parent_inode->size)
-                return 0;
-        }
-        if(count == parent_inode->size)
-            return 0;
+            drop_inode(child_ino);
+        } else if(count == parent_inode->size)
+            ret = 0;
+        drop_block(block_id);
     }
-    return 0;
+    drop_inode(parent_ino);
+    return ret;
 }
 
 static int add_file(int parent_ino, char* name, int* ln_ino){
     //already hold the fs_lock
     inode_t* parent_inode = get_inode(parent_ino);
     dentry_t* new_dentry;
-    for(int i = 0;; i++){
-        int block_id = inode_mapto_block(parent_ino, i, 1);
-        assert(block_id != -1);
-        for(int j = 0; j < SECTOR_IN_BLOCK; j++){
-            dentry_t* dentrys = (dentry_t*)get_sector_of_block(block_id, j);
-            new_dentry = find_empty_dentry(dentrys, DENTRYS_IN_SECTOR);
-            if(new_dentry != NULL){
-                int ino_to_set;
-                if(ln_ino == NULL){
-                    ino_to_set = alloc_inode();
-                    if(ino_to_set<0)
-                        return -1;
-                    init_inode(parent_ino, ino_to_set, 0);
-                } else {
-                    ino_to_set = *ln_ino;
-                    inode_t* ln_inode = get_inode(ino_to_set);
-                    if(ln_inode->nlinks == 0)
-                        return -1;
-                    ln_inode->nlinks++;
-                    put_inode(ino_to_set);
-                }
-                set_dentry(ino_to_set, name, new_dentry);
-                parent_inode->size++;
-                put_inode(parent_ino);
-                put_sector_of_block(block_id, j);
-                return ino_to_set;
-            } else {
-                return -1;
+    int ret = -1;
+    int block_id = inode_mapto_block(parent_ino, 0, 1);
+    assert(block_id != -1);
+    dentry_t* dentrys = (dentry_t*)get_block(block_id);
+    new_dentry = find_empty_dentry(dentrys, DENTRYS_IN_BLOCK);
+    if(new_dentry != NULL){
+        int ino_to_set;
+        if(ln_ino == NULL){
+            ino_to_set = alloc_inode(parent_ino, 0);
+            if(ino_to_set >= 0)
+                init_inode(parent_ino, ino_to_set, 0);
+        } else {
+            ino_to_set = *ln_ino;
+            inode_t* ln_inode = get_inode(ino_to_set);
+            if(ln_inode->nlinks == 0)
+                ino_to_set = -1;
+            else{
+                ln_inode->nlinks++;
+                put_inode(ino_to_set);
             }
+            drop_inode(*ln_ino);
+        }
+        if(ino_to_set >= 0){
+            set_dentry(ino_to_set, name, new_dentry);
+            parent_inode->size++;
+            put_inode(parent_ino);
+            put_block(block_id, (new_dentry - dentrys) * DENTRY_SIZE, DENTRY_SIZE);
+            ret = ino_to_set;
         }
     }
-    return -1;
+    drop_block(block_id);
+    drop_inode(parent_ino);
+    return ret;
 }
 
 static int del_file(int parent_ino, char* name){
     //already hold the fs_lock
     inode_t* parent_inode = get_inode(parent_ino);
     int count = 0;
-    for(int i = 0;; i++){
+    int ret = -1;
+    for(int i = 0; ret == -1; i++){
         int block_id = inode_mapto_block(parent_ino, i, 0);
-        if(block_id == -1)
-            return 0;
-        for(int j = 0; j < SECTOR_IN_BLOCK; j++){
-            dentry_t* dentrys = (dentry_t*)get_sector_of_block(block_id, j);
-            dentry_t* child_dentry = find_dentry_byname(name, &count, dentrys, DENTRYS_IN_SECTOR);
-            if(child_dentry != NULL){
-                int child_ino = child_dentry->inode_num;
-                inode_t* child_inode = get_inode(child_ino);
-                if((child_inode->mode & S_DIR) != 0) // not a file
-                    return -2;
+        if(block_id == -1){
+            ret = 0;
+            break;
+        }
+        dentry_t* dentrys = (dentry_t*)get_block(block_id);
+        dentry_t* child_dentry = find_dentry_byname(name, &count, dentrys, DENTRYS_IN_BLOCK);
+        if(child_dentry != NULL){
+            int child_ino = child_dentry->inode_num;
+            inode_t* child_inode = get_inode(child_ino);
+            if((child_inode->mode & S_DIR) != 0) // not a file
+                ret = -2;
+            else{
                 child_inode->nlinks--;
                 if(child_inode->nlinks == 0) // no links left
                     release_inode(child_ino);
@@ -721,17 +1528,17 @@ static int del_file(int parent_ino, char* name){
                     put_inode(child_ino);
                 set_dentry(-1, "", child_dentry);
                 parent_inode->size--;
-                put_sector_of_block(block_id, j);
+                put_block(block_id, (child_dentry - dentrys) * DENTRY_SIZE, DENTRY_SIZE);
                 put_inode(parent_ino);
-                return 1;
+                ret = 1;
             }
-            if(count == parent_inode->size)
-                return 0;
-        }
-        if(count == parent_inode->size)
-            return 0;
+            drop_inode(child_ino);
+        } else if(count == parent_inode->size)
+            ret = 0;
+        drop_block(block_id);
     }
-    return 0;
+    drop_inode(parent_ino);
+    return ret;
 }
 
 
@@ -796,7 +1603,13 @@ static char* get_name_and_ino_by_path(char* path, int* ret_ino){
 int do_mkfs(){
     int ret;
     acquire(&fs_lock);
-    if(check_fs_in_sd()){//already exist
+    int exist = check_fs_in_sd();
+    if(exist == -1){//older layout
+        release(&fs_lock);
+        return -1;
+    }
+    if(exist){//already exist
+        load_bitmaps();
         ret = 0;
     }
     else{//create new file system
@@ -817,21 +1630,23 @@ int do_statfs(){
     printf("File system information:\n");
     printf(" - Type: %s\n", now_superblock->name);
     printf(" - Begin sector: %d\n", now_superblock->begin_sector);
-    printf(" - Total sectors: %d\n", now_superblock->total_sectors);
+    printf(" - Total sectors: %u\n", now_superblock->total_sectors);
     printf(" - Superblock sector: %d\n", now_superblock->begin_sector);
-    printf(" - Block map begin sector: %d (occupied sectors: %d)\n", now_superblock->blockmap_begin_sector, now_superblock->blockmap_occupied_sectors);
-    printf(" - Inode map begin sector: %d (occupied sectors: %d)\n", now_superblock->inodemap_begin_sector, now_superblock->inodemap_occupied_sectors);
-    printf(" - Inode table begin sector: %d (occupied sectors: %d)\n", now_superblock->inode_table_begin_sector, now_superblock->inode_table_occupied_sectors);
+    printf(" - Group descriptor begin sector: %d (occupied sectors: %d)\n", now_superblock->groupdesc_begin_sector, now_superblock->groupdesc_occupied_sectors);
+    printf(" - Groups: %d ; Blocks per group: %d ; Inodes per group: %d\n", now_superblock->group_num, now_superblock->group_blocks, now_superblock->group_inodes);
     printf(" - Block table begin sector: %d (occupied sectors: %d)\n", now_superblock->block_table_begin_sector, now_superblock->block_table_occupied_sectors);
     printf(" - Inode size: %d ; Inode occupied: %d/%d (%d%%)\n", now_superblock->inode_size, now_superblock->inode_num, now_superblock->inode_max_num, now_superblock->inode_num * 100 / now_superblock->inode_max_num);
-    printf(" - Block size: %d ; Block occupied: %d/%d (%d%%)\n", now_superblock->block_size, now_superblock->block_num, now_superblock->block_max_num, now_superblock->block_num * 100 / now_superblock->block_max_num);
-    uint64_t used_size = (now_superblock->block_num * now_superblock->block_size);
-    uint64_t total_size = (now_superblock->total_sectors * SECTOR_SIZE);
+    // the unused blocks of the preallocation windows count as free, they are given back when space runs out
+    uint32_t block_num = now_superblock->block_num - prealloc_held();
+    int block_percent = (uint64_t)block_num * 100 / now_superblock->block_max_num;
+    printf(" - Block size: %d ; Block occupied: %u/%u (%d%%)\n", now_superblock->block_size, block_num, now_superblock->block_max_num, block_percent);
+    uint64_t used_size = ((uint64_t)block_num * now_superblock->block_size);
+    uint64_t total_size = ((uint64_t)now_superblock->total_sectors * SECTOR_SIZE);
     char used_str[] = "     $B";
     char total_str[] = "     $B";
     char* u = get_memstr(used_str, used_size);
     char* t = get_memstr(total_str, total_size);
-    printf(" - Used: %s / %s (%d%%)\n", u, t, now_superblock->block_num * 100 / now_superblock->block_max_num);
+    printf(" - Used: %s / %s (%d%%)\n", u, t, block_percent);
     release(&fs_lock);
     return 1;
 }
@@ -852,15 +1667,19 @@ int do_pwd(char* buf){
     path[MAX_PATH_LEN-1] = '\0';
     char* p = path + MAX_PATH_LEN - 2;
     int path_len = 0;
-    dentry_t* dentrys = (dentry_t*)get_sector_of_block(inode_mapto_block(now_ino, 0, 0), 0);
+    int block_id = inode_mapto_block(now_ino, 0, 0);
+    dentry_t* dentrys = (dentry_t*)get_block(block_id);
     while(parent_ino != now_superblock->root_ino){
         child_ino = parent_ino;
-        parent_ino = find_dentry_byname("..", NULL, dentrys, DENTRYS_IN_SECTOR)->inode_num;
-        dentrys = (dentry_t*)get_sector_of_block(inode_mapto_block(parent_ino, 0, 0), 0);
-        char* name = find_dentry_byino(child_ino, NULL, dentrys, DENTRYS_IN_SECTOR)->name;
+        parent_ino = find_dentry_byname("..", NULL, dentrys, DENTRYS_IN_BLOCK)->inode_num;
+        drop_block(block_id);
+        block_id = inode_mapto_block(parent_ino, 0, 0);
+        dentrys = (dentry_t*)get_block(block_id);
+        char* name = find_dentry_byino(child_ino, NULL, dentrys, DENTRYS_IN_BLOCK)->name;
         p = p - strlen(name);
         path_len += strlen(name) + 1;
         if(p - path < 1){
+            drop_block(block_id);
             release(&fs_lock);
             return 0;
         }
@@ -869,6 +1688,7 @@ int do_pwd(char* buf){
             *q++ = *name++;
         *p-- = '/';
     }
+    drop_block(block_id);
     // printf("%s\n", p+1);
     strcpy(buf, p+1);
     release(&fs_lock);
@@ -906,6 +1726,7 @@ int do_cd(char* path){
         now_ino = ino;
         ret = 1;
     }
+    drop_inode(ino);
     release(&fs_lock);
     return ret;
 }
@@ -938,6 +1759,7 @@ int do_mkdir(char* path){
     else{
         ret = add_dir(ino, name);
     }
+    drop_inode(ino);
     release(&fs_lock);
     return ret;
 }
@@ -1009,43 +1831,41 @@ int do_ls(char* path, int option){
                 break;
             }
             assert(block_id != -1);
-            for(int j = 0; j < SECTOR_IN_BLOCK; j++){
-                dentry_t* dentrys = (dentry_t*)get_sector_of_block(block_id, j);
-                for(int k = 0; k < DENTRYS_IN_SECTOR; k++){
-                    if(count >= inode->size){
-                        ret = 1;
-                        break;
-                    }
-                    if(dentrys[k].inode_num != -1){
-                        count++;
-                        if((option & LS_ALL) == 0 && dentrys[k].name[0] == '.') continue;
-                        if((option & LS_LONG)){
-                            inode_t* child_inode = get_inode(dentrys[k].inode_num);
-                            char mode[] = "----";
-                            for(int mode_offset = 0; mode_offset < 4; mode_offset++){
-                                if(child_inode->mode & (1 << mode_offset))
-                                    mode[3-mode_offset] = mode_offset["xwrd"];
-                            }
-                            int size = child_inode->size;
-                            if(mode[0] == 'd')
-                                size = 0;
-                            printf("%s %5d  %s\n", mode, size, dentrys[k].name);
-                        } else {//LS_NORMAL
-                            printf("%s\n", dentrys[k].name);
-                        }
-                    }
-                }
+            dentry_t* dentrys = (dentry_t*)get_block(block_id);
+            for(int k = 0; k < DENTRYS_IN_BLOCK; k++){
                 if(count >= inode->size){
                     ret = 1;
                     break;
                 }
+                if(dentrys[k].inode_num != -1){
+                    count++;
+                    if((option & LS_ALL) == 0 && dentrys[k].name[0] == '.') continue;
+                    if((option & LS_LONG)){
+                        int child_ino = dentrys[k].inode_num;
+                        inode_t* child_inode = get_inode(child_ino);
+                        char mode[] = "----";
+                        for(int mode_offset = 0; mode_offset < 4; mode_offset++){
+                            if(child_inode->mode & (1 << mode_offset))
+                                mode[3-mode_offset] = mode_offset["xwrd"];
+                        }
+                        int size = child_inode->size;
+                        drop_inode(child_ino);
+                        if(mode[0] == 'd')
+                            size = 0;
+                        printf("%s %5d  %s\n", mode, size, dentrys[k].name);
+                    } else {//LS_NORMAL
+                        printf("%s\n", dentrys[k].name);
+                    }
+                }
             }
+            drop_block(block_id);
             if(count >= inode->size){
                 ret = 1;
                 break;
             }
         }
     }
+    drop_inode(ino);
     release(&fs_lock);
     return ret;
 }
@@ -1054,6 +1874,7 @@ fdesc_t fdescs[MAX_FD];
 
 void init_fs(){
     spinlock_init(&fs_lock);
+    now_superblock = NULL;
     for(int i = 0; i < MAX_FD; i++){
         fdescs[i].valid = 0;
         fdescs[i].inode_num = -1;
@@ -1061,9 +1882,34 @@ void init_fs(){
         fdescs[i].occupid_pid = -1;
         fdescs[i].mode = 0;
     }
+    for(int i = 0; i < PREALLOC_SLOTS; i++)
+        preallocs[i].ino = -1;
+    for(int i = 0; i < DELALLOC_INODES; i++)
+        delalloc_inodes[i].ino = -1;
+    change_cache_flush_hook(delalloc_flush_hook);
     fs_cache_init();
 }
 
+void release_fs(){
+    // the flusher runs until fs_cache_release, it must find the file system either whole or gone
+    acquire(&fs_lock);
+    if(now_superblock != NULL){
+        delalloc_flush(1);
+        for(int i = 0; i < PREALLOC_SLOTS; i++)
+            prealloc_discard(&preallocs[i]);
+        sector_drop(now_superblock->superblock_sector);
+        now_superblock = NULL;
+    }
+    bitmap_unload(&block_bitmap);
+    bitmap_unload(&inode_bitmap);
+    release(&fs_lock);
+    fs_cache_release();
+}
+
+void change_delalloc(int enable){
+    delalloc_enabled = enable;
+}
+
 static fd_t get_free_fd(){
     for(int i = 0; i < MAX_FD; i++){
         if(fdescs[i].valid == 0){
@@ -1075,9 +1921,24 @@ static fd_t get_free_fd(){
 }
 
 static void release_fd(fd_t fd){
+    // already hold the fs_lock
     assert(fd >= 0 && fd < MAX_FD);
     assert(fdescs[fd].valid == 1);
     fdescs[fd].valid = 0;
+    // the preallocation window of the inode is given back on its last close
+    if(inode_is_open(fdescs[fd].inode_num))
+        return;
+    prealloc_t* pa = prealloc_find(fdescs[fd].inode_num, 0);
+    if(pa != NULL)
+        prealloc_discard(pa);
+}
+
+static int inode_is_open(int ino){
+    // already hold the fs_lock
+    for(int i = 0; i < MAX_FD; i++)
+        if(fdescs[i].valid && fdescs[i].inode_num == ino)
+            return 1;
+    return 0;
 }
 
 int do_find(char* path){
@@ -1105,14 +1966,17 @@ int do_find(char* path){
     else{
         ret = parentino_to_childino(ino, name);
         if (ret != -1){
-            inode_t* child_inode = get_inode(ret);
+            int child_ino = ret;
+            inode_t* child_inode = get_inode(child_ino);
             if(child_inode->mode & S_DIR)//is a directory
                 ret = 2;
             else
                 ret = 1;
+            drop_inode(child_ino);
         } else 
             ret = 0;
     }
+    drop_inode(ino);
     release(&fs_lock);
     return ret;
 }
@@ -1146,9 +2010,11 @@ fd_t do_open(char* path, int mode){
         inode_t* child_inode = get_inode(child_ino);
         if(child_inode->mode & S_DIR)//is a directory
             ret = -1;
+        drop_inode(child_ino);
     } else{
         ret = add_file(ino, name, NULL);
     }
+    drop_inode(ino);
     if(ret >= 0){
         fd_t fd = get_free_fd();
         if(fd == -1){
@@ -1180,6 +2046,7 @@ int do_read(int fd, char *buf, int len){
 
     inode_t* inode = get_inode(ino);
     int size = inode->size;
+    drop_inode(ino);
     if(fdesc->offset >= size){
         release(&fs_lock);
         return 0;
@@ -1196,24 +2063,24 @@ int do_read(int fd, char *buf, int len){
         int block_id = inode_mapto_block(ino, block_index, 0);
         if(block_id == -1){
             int this_len = (suc_len + block_offset > BLOCK_SIZE)? BLOCK_SIZE - block_offset : suc_len;
-            memset(buf, 0, this_len);
+            // a hole, or a block waiting for delayed allocation
+            delalloc_block_t* delayed = delalloc_num > 0 ? delalloc_lookup(ino, block_index) : NULL;
+            if(delayed != NULL)
+                memcpy(buf, delayed->data.data + block_offset, this_len);
+            else
+                memset(buf, 0, this_len);
             buf += this_len;
             suc_len -= this_len;
             fdesc->offset += this_len;
             continue;
         }
-        int sector_index = block_offset / SECTOR_SIZE;
-        int sector_offset = block_offset % SECTOR_SIZE;
-        while(sector_index < SECTOR_IN_BLOCK && suc_len > 0){
-            char* sector_buf = (char *)get_sector_of_block(block_id, sector_index);
-            int this_len = (suc_len + sector_offset > SECTOR_SIZE)? SECTOR_SIZE - sector_offset : suc_len;
-            memcpy(buf, sector_buf + sector_offset, this_len);
-            sector_index++;
-            sector_offset = 0;
-            buf += this_len;
-            suc_len -= this_len;
-            fdesc->offset += this_len;
-        }
+        char* block_buf = (char*)get_block(block_id);
+        int this_len = (suc_len + block_offset > BLOCK_SIZE)? BLOCK_SIZE - block_offset : suc_len;
+        memcpy(buf, block_buf + block_offset, this_len);
+        drop_block(block_id);
+        buf += this_len;
+        suc_len -= this_len;
+        fdesc->offset += this_len;
     }
     release(&fs_lock);
 
@@ -1239,29 +2106,46 @@ int do_write(int fd, char *buf, int len){
         inode->size = new_size;
         put_inode(ino);
     }
+    drop_inode(ino);
 
     int suc_len = len;
     int suc_len_buf = suc_len;
 
+    // new blocks come from a window sized to the write, unless their allocation is delayed,
+    // an overwrite of mapped blocks needs none
+    if(!delalloc_enabled){
+        int first_index = fdesc->offset / BLOCK_SIZE;
+        int end_index = (fdesc->offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int index = first_index;
+        while(index < end_index && inode_mapto_block(ino, index, 0) != -1)
+            index++;
+        if(index < end_index)
+            prealloc_start(ino, first_index, end_index - first_index);
+    }
+
     while(suc_len > 0){
         int block_index = fdesc->offset / BLOCK_SIZE;
         int block_offset = fdesc->offset % BLOCK_SIZE;
-        int block_id = inode_mapto_block(ino, block_index, 1);
-        assert(block_id != -1);
-        int sector_index = block_offset / SECTOR_SIZE;
-        int sector_offset = block_offset % SECTOR_SIZE;
-        while(sector_index < SECTOR_IN_BLOCK && suc_len > 0){
-            char* sector_buf = (char*)get_sector_of_block(block_id, sector_index);
-            int this_len = (suc_len + sector_offset > SECTOR_SIZE)? SECTOR_SIZE - sector_offset : suc_len;
-            memcpy(sector_buf + sector_offset, buf, this_len);
-            put_sector_of_block(block_id, sector_index);
-            sector_index++;
-            sector_offset = 0;
-            buf += this_len;
-            suc_len -= this_len;
-            fdesc->offset += this_len;
+        int this_len = (suc_len + block_offset > BLOCK_SIZE)? BLOCK_SIZE - block_offset : suc_len;
+        delalloc_block_t* delayed = delalloc_get(ino, block_index);
+        if(delayed != NULL){
+            memcpy(delayed->data.data + block_offset, buf, this_len);
+        } else {
+            int block_id = inode_mapto_block(ino, block_index, 1);
+            assert(block_id != -1);
+            // a block overwritten as a whole is not read first
+            char* block_buf = (char*)(this_len == BLOCK_SIZE ? get_new_block(block_id, 0) : get_block(block_id));
+            memcpy(block_buf + block_offset, buf, this_len);
+            put_block(block_id, block_offset, this_len);
+            drop_block(block_id);
         }
+        buf += this_len;
+        suc_len -= this_len;
+        fdesc->offset += this_len;
     }
+    prealloc_t* pa = prealloc_find(ino, 0);
+    if(pa != NULL)
+        pa->want = 0;
     release(&fs_lock);
     return suc_len_buf - suc_len;
 }
@@ -1305,6 +2189,7 @@ int do_lseek(int fd, int offset, int whence){
     int ret = 0;
     inode_t* inode = get_inode(ino);
     int size = inode->size;
+    drop_inode(ino);
     if(whence == SEEK_SET){
         if(offset < 0)
             ret = -1;
@@ -1381,7 +2266,9 @@ int do_ln(char* src_path, char* dst_path){
             break;
         }
         inode_t* src_child_inode = get_inode(src_child_ino);
-        if(src_child_inode->mode & S_DIR){//is a directory
+        int src_child_dir = src_child_inode->mode & S_DIR;
+        drop_inode(src_child_ino);
+        if(src_child_dir){//is a directory
             ret = -4;
             break;
         }
@@ -1395,6 +2282,8 @@ int do_ln(char* src_path, char* dst_path){
             ret = 1;
         break;
     }
+    drop_inode(src_ino);
+    drop_inode(dst_ino);
     release(&fs_lock);
     return ret;
 }
@@ -1433,3 +2322,109 @@ int do_rm(char* path){
     int ret2 = do_rmdir(path);
     return ret2;
 }
+
+int do_truncate(char* path, int size){
+    if(path == NULL || *path == '\0')//invalid path
+        return -1;
+    if(size < 0)//invalid size
+        return -3;
+
+    char path_buf[MAX_PATH_LEN];
+    int len = strlen(path);
+    if(len >= MAX_PATH_LEN){//path too long
+        // printf("path too long\n");
+        return -1;
+    }
+    strcpy(path_buf, path);
+    path = path_buf;
+
+    acquire(&fs_lock);
+    int ino;
+    char* name = get_name_and_ino_by_path(path, &ino);
+
+    int ret;
+    inode_t* inode = get_inode(ino);
+    int child_ino;
+    if(ino == -1)//no such file or directory
+        ret = 0;
+    else if((inode->mode & S_DIR) == 0)//not a directory
+        ret = -1;
+    else if((child_ino = parentino_to_childino(ino, name)) == -1)//no such file
+        ret = 0;
+    else{
+        inode_t* child_inode = get_inode(child_ino);
+        int child_dir = child_inode->mode & S_DIR;
+        drop_inode(child_ino);
+        if(child_dir)//is a directory
+            ret = -2;
+        else{
+            inode_resize(child_ino, size);
+            ret = 1;
+        }
+    }
+    drop_inode(ino);
+    release(&fs_lock);
+    return ret;
+}
+
+int do_fallocate(int fd, int offset, int length){
+    acquire(&fs_lock);
+    if(fd < 0 || fd >= MAX_FD || fdescs[fd].valid == 0){
+        release(&fs_lock);
+        return 0;
+    }
+    fdesc_t* fdesc = &fdescs[fd];
+    if((fdesc->mode & O_WRONLY) == 0 || offset < 0 || length <= 0 || offset > 0x7FFFFFFF - length){
+        release(&fs_lock);
+        return 0;
+    }
+    int ino = fdesc->inode_num;
+
+    // delayed blocks of the file get their place first, what is left unmapped in the range is a hole
+    for(int i = 0; i < DELALLOC_INODES && delalloc_num > 0; i++)
+        if(delalloc_inodes[i].ino == ino)
+            delalloc_flush_inode(&delalloc_inodes[i]);
+    int first_index = offset / BLOCK_SIZE;
+    int last_index = (offset + length - 1) / BLOCK_SIZE;
+    int holes = 0, depths = 0;
+    for(int i = first_index; i <= last_index; i++)
+        if(inode_mapto_block(ino, i, 0) == -1){
+            holes++;
+            depths += block_depth(i);
+        }
+    // with room for the indirect blocks they may need, the blocks left in the window of the file count,
+    // those in the windows of the other files are taken back if it is not enough
+    int indirect = delalloc_indirect(first_index, last_index);
+    int need = holes + (indirect < depths ? indirect : depths);
+    prealloc_t* pa = prealloc_find(ino, 0);
+    int own = pa != NULL ? pa->end - pa->next : 0;
+    if(need > free_blocks() + own){
+        prealloc_reclaim();
+        own = 0;
+    }
+    if(need > free_blocks() + own){
+        release(&fs_lock);
+        return -1;
+    }
+
+    // the holes are filled in order out of a window sized to all of them
+    if(holes > 0){
+        prealloc_start(ino, first_index, holes);
+        for(int i = first_index; i <= last_index; i++){
+            int block_id = inode_mapto_block(ino, i, 1);
+            assert(block_id != -1);
+        }
+        pa = prealloc_find(ino, 0);
+        if(pa != NULL)
+            pa->want = 0;
+    }
+
+    inode_t* inode = get_inode(ino);
+    if(offset + length > inode->size){
+        inode->size = offset + length;
+        put_inode(ino);
+    }
+    drop_inode(ino);
+    release(&fs_lock);
+    return 1;
+}
@@ -4,17 +4,13 @@
 #include "type.h"
 #include "spinlock.h"
 
-#define FILE_SYSTEM_SIZE 512*1024*1024// 512MB
-
 #define SECTOR_SIZE 512
 #define BLOCK_SIZE 4096
 
 #define SECTOR_BIT_SIZE (SECTOR_SIZE * 8)
+#define SECTOR_BIT_WORDS (SECTOR_BIT_SIZE / 64)
 #define SECTOR_IN_BLOCK (BLOCK_SIZE / SECTOR_SIZE)
 
-#define MAX_SECTOR_NUM (FILE_SYSTEM_SIZE/SECTOR_SIZE)
-#define MAX_BLOCK_NUM (FILE_SYSTEM_SIZE/BLOCK_SIZE)
-
 #define SECTORID2BLOCKID(sector_id) ((sector_id) * SECTOR_SIZE / BLOCK_SIZE)
 #define BLOCKID2SECTORID(block_id) ((block_id) * BLOCK_SIZE / SECTOR_SIZE)
 
@@ -23,38 +19,61 @@
 /* macros of file system */
 #define FILE_SYSTEM_BEGIN_SECTOR 0
 
-// | superblock | reserves |  blockmap | inodemap |inode table | data_blocks | 
-// 0            1          8           40         41          72            1024*1024
-
-#define SUPERBLOCK_MAGIC 0xDF4C4459
+// | superblock | reserves | group descriptors | group 0 | group 1 | ... | group G-1 |
+// 0            1          8                   8+D (aligned to 8)                    total_sectors
+// D = group descriptor sectors, G = groups, both sized at mkfs from the device size (16 groups for 512MB)
+//
+// every group holds GROUP_BLOCKS blocks, the last one may be shorter, and starts with its own metadata:
+// | blockmap | inodemap | reserves | inode table | data_blocks |
+// 0          2          3          8             520           GROUP_BLOCKS * 8
+// block ids and inode numbers are global, group g has blocks from g * GROUP_BLOCKS and inodes from
+// g * GROUP_INODES, its metadata blocks are marked used in its blockmap
+
+#define SUPERBLOCK_MAGIC 0xDF4C445A
+// the single-bitmap layout before block groups, such an image is never mounted nor formatted over
+#define SUPERBLOCK_MAGIC_V1 0xDF4C4459
 #define FILE_SYSTEM_NAME "grfs"
 #define SUPERBLOCK_BEGIN_SECTOR 0
 
+#define GROUPDESC_BEGIN_SECTOR 8
+#define GROUPDESC_SIZE 16
+#define GROUPDESCS_IN_SECTOR (SECTOR_SIZE / GROUPDESC_SIZE)
 
-#define BLOCKMAP_BEGIN_SECTOR 8
-#define BLOCKMAP_OCCUPIED_SECTORS 32
+#define INODE_SIZE 64
 
+#define GROUP_BLOCKS 8192
+#define GROUP_SECTORS (GROUP_BLOCKS * SECTOR_IN_BLOCK)
+#define GROUP_BLOCKMAP_SECTORS (GROUP_BLOCKS / SECTOR_BIT_SIZE)
+#define GROUP_INODEMAP_SECTOR GROUP_BLOCKMAP_SECTORS
+#define GROUP_INODEMAP_SECTORS 1
+#define GROUP_INODES (GROUP_INODEMAP_SECTORS * SECTOR_BIT_SIZE)
+#define GROUP_INODE_TABLE_SECTOR SECTOR_IN_BLOCK
+#define GROUP_INODE_TABLE_SECTORS (GROUP_INODES * INODE_SIZE / SECTOR_SIZE)
+#define GROUP_META_BLOCKS ((GROUP_INODE_TABLE_SECTOR + GROUP_INODE_TABLE_SECTORS) / SECTOR_IN_BLOCK)
+// a shorter last group needs at least as many data blocks as metadata blocks, else it is left out
+#define GROUP_MIN_BLOCKS (2 * GROUP_META_BLOCKS)
 
-#define INODEMAP_BEGIN_SECTOR 40
-#define INODEMAP_OCCUPIED_SECTORS 1
+#define DENTRY_SIZE 32
 
-#define INODE_TABLE_BEGIN_SECTOR 41
-#define INODE_TABLE_OCCUPIED_SECTORS 31
-#define INODE_SIZE 64
-#define INODE_MAX_NUM (INODE_TABLE_OCCUPIED_SECTORS * SECTOR_SIZE / INODE_SIZE)
+// blocks reserved ahead of a file being written, one window per inode with an open file
+#define PREALLOC_SLOTS MAX_FD
+#define PREALLOC_MIN_WINDOW 64
+#define PREALLOC_MAX_WINDOW 1024
+#define PREALLOC_RESERVE 32 // free blocks a window refill leaves to the other files
 
-#define DENTRY_SIZE 32
+// delayed allocation, see change_delalloc: blocks written into holes wait in memory for a place on the device
+#define DELALLOC_MAX_BLOCKS 4096 // all of them are allocated when one more is needed
+#define DELALLOC_INODES 64 // inodes with delayed blocks, the oldest is allocated to make room
+#define DELALLOC_HASH 4096
+#define DELALLOC_EXPIRE 10 // seconds, the flusher allocates the blocks of an inode delayed for longer
 
-#define BLOCK_TABLE_BEGIN_SECTOR 72
-#define BLOCK_TABLE_OCCUPIED_SECTORS (MAX_SECTOR_NUM - BLOCK_TABLE_BEGIN_SECTOR)
-#define BLOCK_SIZE 4096
-#define BLOCK_MAX_NUM (BLOCK_TABLE_OCCUPIED_SECTORS * SECTOR_SIZE / BLOCK_SIZE)
 
 #define INODES_IN_SECTOR (SECTOR_SIZE / INODE_SIZE)
 #define DENTRYS_IN_SECTOR (SECTOR_SIZE / DENTRY_SIZE)
 #define DENTRYS_IN_BLOCK (BLOCK_SIZE / DENTRY_SIZE)
 
 /* data structures of file system */
+// sector counts are 32-bit on disk (up to 2TB), all sector arithmetic in memory is 64-bit
 typedef struct  __attribute__((aligned(SECTOR_SIZE))) superblock {
     uint32_t magic;
     uint32_t begin_sector;
@@ -63,14 +82,12 @@ typedef struct  __attribute__((aligned(SECTOR_SIZE))) superblock {
     uint32_t root_ino;
     char name[32];
 
-    uint32_t inodemap_begin_sector;
-    uint32_t inodemap_occupied_sectors;
+    uint32_t groupdesc_begin_sector;
+    uint32_t groupdesc_occupied_sectors;
+    uint32_t group_num;
+    uint32_t group_blocks;
+    uint32_t group_inodes;
 
-    uint32_t blockmap_begin_sector;
-    uint32_t blockmap_occupied_sectors;
-
-    uint32_t inode_table_begin_sector;
-    uint32_t inode_table_occupied_sectors;
     uint32_t inode_size;
     uint32_t inode_num;
     uint32_t inode_max_num;
@@ -84,6 +101,14 @@ typedef struct  __attribute__((aligned(SECTOR_SIZE))) superblock {
     uint32_t block_max_num;
 } superblock_t;
 
+// free counts of a group, kept in step with its bitmaps
+typedef struct groupdesc {
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t dir_num;
+    uint32_t reserved;
+} groupdesc_t;
+
 typedef struct dentry {
     char name[28];
     uint32_t inode_num;
@@ -145,10 +170,23 @@ extern int now_ino;
 void init_fs(void);
 
 /**
- * @brief make a new file system
+ * @brief write back the cache and stop its flusher before the device is released
+ */
+void release_fs(void);
+
+/**
+ * @brief turn delayed allocation on or off (off by default)
+ * @note with it on, do_write only reserves space for blocks not mapped yet, they are allocated
+ *       in contiguous runs by the flusher or cache_flush, or never if the file goes away first
+ */
+void change_delalloc(int enable);
+
+/**
+ * @brief make a new file system, or mount the one on the device
  * @return the finish status of mkfs
- * @retval 1 success
- * @retval 0 fail
+ * @retval  1 success
+ * @retval  0 fail (already exist, mounted)
+ * @retval -1 the device holds a file system of an older layout, left as it is and not mounted
  */
 int do_mkfs(void);
 
@@ -318,5 +356,30 @@ int do_rmnod(char *path);
  */
 int do_rm(char *path);
 
+/**
+ * @brief shrink or extend a file
+ * @param path the path of the file
+ * @param size the new size in bytes, the blocks past it are released, an extension reads as zeros
+ * @return the finish status of truncate
+ * @retval  1 success
+ * @retval  0 no such file
+ * @retval -1 invalid path
+ * @retval -2 is a directory
+ * @retval -3 invalid size
+ */
+int do_truncate(char *path, int size);
+
+/**
+ * @brief reserve the blocks of a range of a file up front, contiguous where the device allows
+ * @param fd the fd of the file, opened for writing
+ * @param offset the first byte of the range
+ * @param length the bytes of the range, the file is extended to cover it
+ * @return the finish status of fallocate
+ * @retval  1 success
+ * @retval  0 invalid fd or range
+ * @retval -1 no space left
+ */
+int do_fallocate(int fd, int offset, int length);
+
 
 #endif /* GDFS_H */
\ No newline at end of file
@@ -1,26 +1,424 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "io.h"
 
+typedef struct io_backend {
+    const char* name;
+    int (*open)(const char* path);
+    void (*close)();
+    void (*read)(char* buf, size_t size, off_t offset);
+    void (*write)(char* buf, size_t size, off_t offset);
+    // optional, one contiguous run on disk; NULL falls back to read/write per segment
+    void (*readv)(struct iovec* iov, int iovcnt, off_t offset);
+    void (*writev)(struct iovec* iov, int iovcnt, off_t offset);
+} io_backend_t;
 
 FILE *img;
+pthread_mutex_t img_lock = PTHREAD_MUTEX_INITIALIZER;
+int img_fd = -1;
+char* img_map = NULL;
+size_t img_map_size = 0;
+
+static int io_backend = IO_BACKEND_PREAD;
+static const char* img_path = IMAGE_PATH;
+static uint64_t img_size = 0;
+static uint64_t img_sectors = 0;
+
+static io_stat_t io_stat;
+
+/* stdio backend: the original buffered path, kept for comparison */
+
+static int stdio_open(const char* path){
+    img = fopen(path, "rb+");
+    return img != NULL;
+}
+
+static void stdio_close(){
+    fclose(img);
+}
+
+static void stdio_read(char* buf, size_t size, off_t offset){
+    // the seek pointer is shared, aio workers must not interleave here
+    pthread_mutex_lock(&img_lock);
+    fseek(img, offset, SEEK_SET);
+    fread(buf, 1, size, img);
+    pthread_mutex_unlock(&img_lock);
+}
+
+static void stdio_write(char* buf, size_t size, off_t offset){
+    pthread_mutex_lock(&img_lock);
+    fseek(img, offset, SEEK_SET);
+    fwrite(buf, 1, size, img);
+    pthread_mutex_unlock(&img_lock);
+}
+
+/* pread backend: positional I/O on a raw fd, no libc buffer and no shared seek pointer */
+
+static int pread_open(const char* path){
+    img_fd = open(path, O_RDWR);
+    return img_fd >= 0;
+}
+
+static void fd_close(){
+    close(img_fd);
+    img_fd = -1;
+}
+
+static void fd_read(char* buf, size_t size, off_t offset){
+    while(size > 0){
+        ssize_t n = pread(img_fd, buf, size, offset);
+        assert(n >= 0);
+        if(n == 0){ // past the end of the image
+            memset(buf, 0, size);
+            return;
+        }
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+static void fd_write(char* buf, size_t size, off_t offset){
+    while(size > 0){
+        ssize_t n = pwrite(img_fd, buf, size, offset);
+        assert(n > 0);
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+static size_t iov_total(struct iovec* iov, int iovcnt){
+    size_t size = 0;
+    for(int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    return size;
+}
+
+// finish a vectored transfer that stopped after done bytes
+static void fd_finish_vector(int write, struct iovec* iov, int iovcnt, off_t offset, size_t done){
+    for(int i = 0; i < iovcnt; i++){
+        if(done >= iov[i].iov_len){
+            done -= iov[i].iov_len;
+        } else if(write){
+            fd_write((char*)iov[i].iov_base + done, iov[i].iov_len - done, offset + done);
+            done = 0;
+        } else {
+            fd_read((char*)iov[i].iov_base + done, iov[i].iov_len - done, offset + done);
+            done = 0;
+        }
+        offset += iov[i].iov_len;
+    }
+}
+
+static void fd_readv(struct iovec* iov, int iovcnt, off_t offset){
+    ssize_t n = preadv(img_fd, iov, iovcnt, offset);
+    assert(n >= 0);
+    if(n < iov_total(iov, iovcnt))
+        fd_finish_vector(0, iov, iovcnt, offset, n);
+}
+
+static void fd_writev(struct iovec* iov, int iovcnt, off_t offset){
+    ssize_t n = pwritev(img_fd, iov, iovcnt, offset);
+    assert(n >= 0);
+    if(n < iov_total(iov, iovcnt))
+        fd_finish_vector(1, iov, iovcnt, offset, n);
+}
+
+/* direct backend: O_DIRECT, transfers must be IO_DIRECT_ALIGN aligned in memory and on disk */
+
+static int direct_open(const char* path){
+    img_fd = open(path, O_RDWR | O_DIRECT);
+    return img_fd >= 0;
+}
+
+static int direct_aligned(char* buf, size_t size, off_t offset){
+    return ((unsigned long)buf % IO_DIRECT_ALIGN) == 0
+        && (size % IO_DIRECT_ALIGN) == 0
+        && (offset % IO_DIRECT_ALIGN) == 0;
+}
+
+static char* direct_bounce(size_t size, off_t offset, off_t* begin, size_t* span){
+    *begin = offset / IO_DIRECT_ALIGN * IO_DIRECT_ALIGN;
+    off_t end = (offset + size + IO_DIRECT_ALIGN - 1) / IO_DIRECT_ALIGN * IO_DIRECT_ALIGN;
+    *span = end - *begin;
+    void* bounce = NULL;
+    int ret = posix_memalign(&bounce, IO_DIRECT_ALIGN, *span);
+    assert(ret == 0);
+    return (char*)bounce;
+}
+
+static void direct_read(char* buf, size_t size, off_t offset){
+    if(direct_aligned(buf, size, offset)){
+        fd_read(buf, size, offset);
+        return;
+    }
+    off_t begin;
+    size_t span;
+    char* bounce = direct_bounce(size, offset, &begin, &span);
+    fd_read(bounce, span, begin);
+    memcpy(buf, bounce + (offset - begin), size);
+    free(bounce);
+}
+
+static void direct_write(char* buf, size_t size, off_t offset){
+    if(direct_aligned(buf, size, offset)){
+        fd_write(buf, size, offset);
+        return;
+    }
+    off_t begin;
+    size_t span;
+    char* bounce = direct_bounce(size, offset, &begin, &span);
+    if(begin != offset || span != size) // partial edge blocks, read-modify-write
+        fd_read(bounce, span, begin);
+    memcpy(bounce + (offset - begin), buf, size);
+    fd_write(bounce, span, begin);
+    free(bounce);
+}
+
+/* mmap backend: the image is mapped once, cached blocks live in the mapping itself */
+
+static int mmap_open(const char* path){
+    struct stat st;
+    img_fd = open(path, O_RDWR);
+    if(img_fd < 0)
+        return 0;
+    if(fstat(img_fd, &st) != 0 || st.st_size == 0){
+        fd_close();
+        return 0;
+    }
+    img_map_size = st.st_size;
+    img_map = mmap(NULL, img_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, img_fd, 0);
+    if(img_map == MAP_FAILED){
+        img_map = NULL;
+        fd_close();
+        return 0;
+    }
+    return 1;
+}
+
+static void mmap_close(){
+    msync(img_map, img_map_size, MS_SYNC);
+    munmap(img_map, img_map_size);
+    img_map = NULL;
+    fd_close();
+}
+
+static void mmap_read(char* buf, size_t size, off_t offset){
+    assert(offset + size <= img_map_size);
+    if(buf != img_map + offset)
+        memcpy(buf, img_map + offset, size);
+}
+
+static void mmap_write(char* buf, size_t size, off_t offset){
+    assert(offset + size <= img_map_size);
+    if(buf != img_map + offset)
+        memcpy(img_map + offset, buf, size);
+    // the range is already in the shared page cache, just schedule it for write-out
+    off_t begin = offset / getpagesize() * getpagesize();
+    msync(img_map + begin, size + (offset - begin), MS_ASYNC);
+}
+
+static int direct_vector_aligned(struct iovec* iov, int iovcnt, off_t offset){
+    for(int i = 0; i < iovcnt; i++){
+        if(!direct_aligned(iov[i].iov_base, iov[i].iov_len, offset))
+            return 0;
+        offset += iov[i].iov_len;
+    }
+    return 1;
+}
+
+static void direct_readv(struct iovec* iov, int iovcnt, off_t offset){
+    if(direct_vector_aligned(iov, iovcnt, offset)){
+        fd_readv(iov, iovcnt, offset);
+        return;
+    }
+    for(int i = 0; i < iovcnt; offset += iov[i].iov_len, i++)
+        direct_read(iov[i].iov_base, iov[i].iov_len, offset);
+}
+
+static void direct_writev(struct iovec* iov, int iovcnt, off_t offset){
+    if(direct_vector_aligned(iov, iovcnt, offset)){
+        fd_writev(iov, iovcnt, offset);
+        return;
+    }
+    for(int i = 0; i < iovcnt; offset += iov[i].iov_len, i++)
+        direct_write(iov[i].iov_base, iov[i].iov_len, offset);
+}
+
+static io_backend_t io_backends[] = {
+    [IO_BACKEND_STDIO] = {"stdio", stdio_open, stdio_close, stdio_read, stdio_write, NULL, NULL},
+    [IO_BACKEND_PREAD] = {"pread", pread_open, fd_close, fd_read, fd_write, fd_readv, fd_writev},
+    [IO_BACKEND_DIRECT] = {"direct", direct_open, fd_close, direct_read, direct_write, direct_readv, direct_writev},
+    [IO_BACKEND_MMAP] = {"mmap", mmap_open, mmap_close, mmap_read, mmap_write, NULL, NULL},
+};
+
+#define IO_BACKEND_NUM (int)(sizeof(io_backends) / sizeof(io_backends[0]))
+
+void change_io_backend(int backend){
+    assert(backend >= 0 && backend < IO_BACKEND_NUM);
+    io_backend = backend;
+}
+
+int get_io_backend(){
+    return io_backend;
+}
+
+const char* io_backend_name(int backend){
+    if(backend < 0 || backend >= IO_BACKEND_NUM)
+        return NULL;
+    return io_backends[backend].name;
+}
+
+void change_image_path(const char* path){
+    img_path = path;
+}
+
+const char* get_image_path(){
+    return img_path;
+}
+
+void change_image_size(uint64_t size){
+    img_size = size;
+}
+
+uint64_t bios_sd_sectors(){
+    return img_sectors;
+}
 
 void init_io(){
-    img = fopen(IMAGE_PATH, "rb+");
+    struct stat st;
+    if(stat(img_path, &st) != 0){
+        printf("io: cannot open image '%s'\n", img_path);
+        exit(1);
+    }
+    if(img_size > (uint64_t)st.st_size){
+        int ret = truncate(img_path, img_size);
+        assert(ret == 0);
+    } else if(img_size == 0)
+        img_size = st.st_size;
+    img_sectors = img_size / 512;
+    io_reset_stat();
+
+    if(!io_backends[io_backend].open(img_path)){
+        // e.g. O_DIRECT on a file system that does not support it
+        printf("io: backend '%s' unavailable, falling back to stdio\n", io_backends[io_backend].name);
+        io_backend = IO_BACKEND_STDIO;
+        io_backends[io_backend].open(img_path);
+    }
+    init_aio();
 }
 
 void release_io(){
-    fclose(img);
+    release_aio();
+    io_backends[io_backend].close();
+}
+
+void bios_sd_read(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id) {
+    assert(start_sector_id + num_of_sectors <= img_sectors);
+    io_backends[io_backend].read((char*)buf_addr, (size_t)num_of_sectors * 512, (off_t)start_sector_id * 512);
+    io_account(0, (size_t)num_of_sectors * 512);
+    io_throttle(start_sector_id, (size_t)num_of_sectors * 512);
+}
+
+void bios_sd_write(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id) {
+    assert(start_sector_id + num_of_sectors <= img_sectors);
+    io_backends[io_backend].write((char*)buf_addr, (size_t)num_of_sectors * 512, (off_t)start_sector_id * 512);
+    io_account(1, (size_t)num_of_sectors * 512);
+    io_throttle(start_sector_id, (size_t)num_of_sectors * 512);
+}
+
+int bios_sd_run_len(io_seg_t* segs, int num_of_segs) {
+    int run = 1;
+    while(run < num_of_segs && run < IO_MAX_SEGS
+        && segs[run-1].start_sector_id + segs[run-1].num_of_sectors == segs[run].start_sector_id)
+        run++;
+    return run;
+}
+
+static void bios_sd_vector(int write, io_seg_t* segs, int num_of_segs) {
+    io_backend_t* backend = &io_backends[io_backend];
+    struct iovec iov[IO_MAX_SEGS];
+    while(num_of_segs > 0){
+        int run = bios_sd_run_len(segs, num_of_segs);
+        off_t offset = (off_t)segs[0].start_sector_id * 512;
+        size_t size = 0;
+        for(int i = 0; i < run; i++){
+            assert(segs[i].start_sector_id + segs[i].num_of_sectors <= img_sectors);
+            iov[i].iov_base = (void*)segs[i].buf_addr;
+            iov[i].iov_len = (size_t)segs[i].num_of_sectors * 512;
+            size += iov[i].iov_len;
+        }
+        if(write && backend->writev != NULL)
+            backend->writev(iov, run, offset);
+        else if(!write && backend->readv != NULL)
+            backend->readv(iov, run, offset);
+        else{
+            for(int i = 0; i < run; offset += iov[i].iov_len, i++){
+                if(write)
+                    backend->write(iov[i].iov_base, iov[i].iov_len, offset);
+                else
+                    backend->read(iov[i].iov_base, iov[i].iov_len, offset);
+            }
+        }
+        io_account(write, size);
+        io_throttle(segs[0].start_sector_id, size);
+        segs += run;
+        num_of_segs -= run;
+    }
 }
 
-void bios_sd_read(unsigned long buf_addr, unsigned num_of_sectors, unsigned start_sector_id) {
-    assert(start_sector_id<MAX_SECTORS);
-    fseek(img, start_sector_id*512, SEEK_SET);
-    fread((void*)buf_addr, 512, num_of_sectors, img);
+void bios_sd_readv(io_seg_t* segs, int num_of_segs) {
+    bios_sd_vector(0, segs, num_of_segs);
 }
 
-void bios_sd_write(unsigned long buf_addr, unsigned num_of_sectors, unsigned start_sector_id) {
-    assert(start_sector_id<MAX_SECTORS);
-    fseek(img, start_sector_id*512, SEEK_SET);
-    fwrite((void*)buf_addr, 512, num_of_sectors, img);
-}
\ No newline at end of file
+void bios_sd_writev(io_seg_t* segs, int num_of_segs) {
+    bios_sd_vector(1, segs, num_of_segs);
+}
+
+void* bios_sd_map(uint64_t start_sector_id) {
+    if(img_map == NULL)
+        return NULL;
+    assert(start_sector_id * 512 < img_map_size);
+    return img_map + start_sector_id * 512;
+}
+
+void io_account(int write, size_t size) {
+    // several aio workers and the flusher transfer at once, a lock would serialize them here
+    if(write){
+        __atomic_add_fetch(&io_stat.write_ops, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&io_stat.write_bytes, size, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&io_stat.read_ops, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&io_stat.read_bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+void io_get_stat(io_stat_t* stat) {
+    stat->read_ops = __atomic_load_n(&io_stat.read_ops, __ATOMIC_RELAXED);
+    stat->read_bytes = __atomic_load_n(&io_stat.read_bytes, __ATOMIC_RELAXED);
+    stat->write_ops = __atomic_load_n(&io_stat.write_ops, __ATOMIC_RELAXED);
+    stat->write_bytes = __atomic_load_n(&io_stat.write_bytes, __ATOMIC_RELAXED);
+}
+
+void io_reset_stat() {
+    __atomic_store_n(&io_stat.read_ops, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&io_stat.read_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&io_stat.write_ops, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&io_stat.write_bytes, 0, __ATOMIC_RELAXED);
+}
+
+int bios_sd_fd() {
+    if(io_backend == IO_BACKEND_PREAD || io_backend == IO_BACKEND_DIRECT)
+        return img_fd;
+    return -1;
+}
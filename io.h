@@ -1,15 +1,200 @@
 #ifndef IO_H
 #define IO_H
 
-#define IMAGE_SIZE 512*1024*1024 // 512MB
+#include <stddef.h>
+#include "type.h"
 
-#define MAX_SECTORS (IMAGE_SIZE/512)
+#define IMAGE_PATH "image" // default image, see change_image_path
 
-#define IMAGE_PATH "image"
+/* device backends */
+#define IO_BACKEND_STDIO 0  /* buffered FILE*, fseek + fread/fwrite */
+#define IO_BACKEND_PREAD 1  /* raw fd, positional pread/pwrite */
+#define IO_BACKEND_DIRECT 2 /* raw fd opened with O_DIRECT, aligned 4 KiB transfers */
+#define IO_BACKEND_MMAP 3   /* whole image mapped once, cache blocks point into the mapping */
+
+#define IO_DIRECT_ALIGN 4096
+
+/**
+ * @brief select the device backend, must be called before init_io
+ * @param backend IO_BACKEND_STDIO, IO_BACKEND_PREAD, IO_BACKEND_DIRECT or IO_BACKEND_MMAP
+ */
+void change_io_backend(int backend);
+
+/**
+ * @brief get the backend in use (after init_io it reflects any fallback)
+ */
+int get_io_backend();
+
+/**
+ * @brief get the name of a backend, e.g. "pread"
+ * @return the name, or NULL for an unknown backend
+ */
+const char* io_backend_name(int backend);
+
+/**
+ * @brief select the image file, must be called before init_io
+ */
+void change_image_path(const char* path);
+const char* get_image_path();
+
+/**
+ * @brief set the device size in bytes, must be called before init_io
+ * @note 0 (the default) uses the size of the image file, a larger size extends the file
+ */
+void change_image_size(uint64_t size);
+
+/**
+ * @brief get the number of sectors of the device
+ */
+uint64_t bios_sd_sectors();
 
 void init_io();
 void release_io();
-void bios_sd_read(unsigned long buf_addr, unsigned num_of_sectors, unsigned start_sector_id);
-void bios_sd_write(unsigned long buf_addr, unsigned num_of_sectors, unsigned start_sector_id);
+void bios_sd_read(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id);
+void bios_sd_write(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id);
+
+/* one piece of a scatter/gather transfer */
+typedef struct io_seg {
+    unsigned long buf_addr;
+    unsigned num_of_sectors;
+    uint64_t start_sector_id;
+} io_seg_t;
+
+#define IO_MAX_SEGS 64 /* segments issued as one preadv/pwritev at most */
+
+/**
+ * @brief read/write a list of segments
+ * @note neighbouring segments that are adjacent on disk are merged into a single
+ *       preadv/pwritev, so pass them sorted by sector to get the most out of it
+ */
+void bios_sd_readv(io_seg_t* segs, int num_of_segs);
+void bios_sd_writev(io_seg_t* segs, int num_of_segs);
+
+/**
+ * @brief count the leading segments that form one run on disk (at most IO_MAX_SEGS)
+ */
+int bios_sd_run_len(io_seg_t* segs, int num_of_segs);
+
+/**
+ * @brief get the address of a sector inside the image mapping
+ * @return the address, or NULL if the backend is not IO_BACKEND_MMAP
+ * @note writing a mapped range back with bios_sd_write only syncs it, no copy is made
+ */
+void* bios_sd_map(uint64_t start_sector_id);
+
+/* transfers that reached the device, a vectored run counts as one operation */
+typedef struct io_stat {
+    uint64_t read_ops;
+    uint64_t read_bytes;
+    uint64_t write_ops;
+    uint64_t write_bytes;
+} io_stat_t;
+
+/**
+ * @brief get the device statistics since init_io or the last io_reset_stat
+ * @note the counters are atomic, any thread may read or reset them
+ */
+void io_get_stat(io_stat_t* stat);
+void io_reset_stat();
+
+/**
+ * @brief count a transfer that bypassed bios_sd_* (io_uring)
+ */
+void io_account(int write, size_t size);
+
+/**
+ * @brief get the raw fd of the image
+ * @return the fd, or -1 if the backend is not fd based (stdio, mmap)
+ */
+int bios_sd_fd();
+
+/* device emulation (throttle.c), applied on top of any backend except mmap hits */
+#define IO_THROTTLE_NONE 0
+#define IO_THROTTLE_HDD 1    /* 8 ms seek unless sequential, 160 MB/s, queue depth 1 */
+#define IO_THROTTLE_SATA 2   /* 80 us per request, 520 MB/s, queue depth 32 */
+#define IO_THROTTLE_NVME 3   /* 15 us per request, 3000 MB/s, queue depth 128 */
+#define IO_THROTTLE_CUSTOM 4 /* set through change_io_throttle_params */
+
+/**
+ * @brief emulate a device profile so benchmarks see storage costs instead of memcpy
+ * @note the aio engine switches to the thread pool, sized to the queue depth
+ */
+void change_io_throttle(int profile);
+void change_io_throttle_params(unsigned latency_us, unsigned seek_us, unsigned bandwidth_mb, unsigned queue_depth);
+const char* io_throttle_name(int profile);
+
+/**
+ * @brief get the emulated queue depth, 0 if no throttling
+ */
+int get_io_throttle_queue_depth();
+
+/**
+ * @brief charge one request to the emulated device, sleeps until it would have completed
+ */
+void io_throttle(uint64_t start_sector_id, size_t size);
+
+/* asynchronous I/O engine (aio.c), started by init_io */
+#define AIO_ENGINE_URING 0   /* one io_uring submission per batch, completions reaped in bulk */
+#define AIO_ENGINE_THREADS 1 /* thread pool over bios_sd_read/bios_sd_write */
+
+#define AIO_QUEUE_DEPTH 256
+#define AIO_THREAD_NUM 4
+#define AIO_MAX_THREAD_NUM 64 /* thread pool size when emulating a deep device queue */
+
+/**
+ * @brief select the aio engine, must be called before init_io
+ * @note falls back to AIO_ENGINE_THREADS if io_uring is unavailable or the backend has no fd
+ */
+void change_aio_engine(int engine);
+int get_aio_engine();
+
+void init_aio();
+void release_aio();
+
+/**
+ * @brief queue an asynchronous read/write, nothing is issued until aio_submit
+ * @return a ticket to wait on
+ * @note if all AIO_QUEUE_DEPTH slots are busy this waits for the oldest request
+ */
+unsigned aio_read(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id);
+unsigned aio_write(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id);
+
+/**
+ * @brief queue a scatter/gather transfer, merged into runs like bios_sd_readv/bios_sd_writev
+ * @return the ticket of the last request, which covers every segment when they form one run
+ * @note a list may turn into several requests, wait for them with aio_wait_all
+ */
+unsigned aio_readv(io_seg_t* segs, int num_of_segs);
+unsigned aio_writev(io_seg_t* segs, int num_of_segs);
+
+/**
+ * @brief submit every queued request as one batch
+ */
+void aio_submit();
+
+/**
+ * @brief wait for one request, submitting it first if it is still queued
+ */
+void aio_wait(unsigned ticket);
+
+/**
+ * @brief submit everything queued and wait until nothing is in flight
+ */
+void aio_wait_all();
+
+/* write scheduler (elevator.c), sits between write-back and the aio engine */
+#define ELV_MAX_REQUEST_SECTORS 256 /* 128 KiB per merged write at most */
+
+/**
+ * @brief hand a write to the scheduler, nothing is issued until elv_dispatch
+ * @note the buffer must stay untouched until elv_dispatch returns
+ */
+void elv_queue_write(unsigned long buf_addr, unsigned num_of_sectors, uint64_t start_sector_id);
+
+/**
+ * @brief sort the queued writes by sector, merge adjacent ones into requests of at most
+ *        ELV_MAX_REQUEST_SECTORS, issue them in one C-LOOK sweep and wait for completion
+ */
+void elv_dispatch();
 
-#endif /* IO_H */
\ No newline at end of file
+#endif /* IO_H */
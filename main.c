@@ -2,7 +2,9 @@
 #include "io.h"
 #include "cache.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 int now_ino;
 
@@ -22,6 +24,26 @@ int _term_history_index_now = 0;
 
 char cwd[MAX_BUFFER_SIZE] = "/";
 
+// "512M", "20G", ... to bytes, 0 if invalid
+static uint64_t parse_size(char* str){
+    uint64_t size = 0;
+    if(*str < '0' || *str > '9')
+        return 0;
+    while(*str >= '0' && *str <= '9')
+        size = size * 10 + (*str++ - '0');
+    char units[] = "KMGT";
+    for(int i = 0; i < 4; i++){
+        if(*str == units[i] || *str == units[i] + ('a' - 'A')){
+            size <<= 10 * (i + 1);
+            str++;
+            break;
+        }
+    }
+    if(*str == 'B' || *str == 'b')
+        str++;
+    return *str == '\0' ? size : 0;
+}
+
 static wrong_tag_t run_mkfs(int argc, char** argv){
     if(argc > 1){
         printf("  [MKFS]\033[31m The command 'mkfs' does not need any arguments.\033[0m\n");
@@ -30,6 +52,9 @@ static wrong_tag_t run_mkfs(int argc, char** argv){
     int ret = do_mkfs();
     if(ret == 1){
         printf("  [MKFS]\033[32m The file system has been created.\033[0m\n");
+    }else if(ret == -1){
+        printf("  [MKFS]\033[31m The image holds a file system of an older layout.\033[0m\n");
+        return NORMAL_ERROR;
     }else{
         printf("  [MKFS]\033[31m The file hae already existed.\033[0m\n");
         return NORMAL_ERROR;
@@ -357,6 +382,150 @@ static wrong_tag_t run_cat(int argc, char** argv){
     return NO_ERROR;
 }
 
+static wrong_tag_t run_truncate(int argc, char** argv){
+    if(argc != 3){
+        printf("  [TRUNCATE]\033[31m Invalid arguments.\033[0m\n");
+        printf("      Usage: truncate [Size] [File]\n");
+        return NORMAL_ERROR;
+    }
+    uint64_t size = parse_size(argv[1]);
+    if((size == 0 && strspn(argv[1], "0") != strlen(argv[1])) || size > 0x7FFFFFFF){
+        printf("  [TRUNCATE]\033[31m Invalid size \033[0m'%s'\n", argv[1]);
+        return NORMAL_ERROR;
+    }
+    int ret = do_truncate(argv[2], size);
+    if(ret == -2){
+        printf("  [TRUNCATE]\033[31m Is a directory.\033[0m\n");
+        return NORMAL_ERROR;
+    } else if(ret == -1){
+        printf("  [TRUNCATE]\033[31m Invalid path \033[0m'%s'\n", argv[2]);
+        return NORMAL_ERROR;
+    } else if(ret == 0){
+        printf("  [TRUNCATE]\033[31m No such file.\033[0m\n");
+        return NORMAL_ERROR;
+    } else if(ret != 1){
+        printf("  [TRUNCATE]\033[31m Invalid size \033[0m'%s'\n", argv[1]);
+        return NORMAL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+static wrong_tag_t run_fallocate(int argc, char** argv){
+    if(argc != 3){
+        printf("  [FALLOCATE]\033[31m Invalid arguments.\033[0m\n");
+        printf("      Usage: fallocate [Size] [File]\n");
+        return NORMAL_ERROR;
+    }
+    uint64_t size = parse_size(argv[1]);
+    if(size == 0 || size > 0x7FFFFFFF){
+        printf("  [FALLOCATE]\033[31m Invalid size \033[0m'%s'\n", argv[1]);
+        return NORMAL_ERROR;
+    }
+    int find = do_find(argv[2]);
+    if(find == 2){
+        printf("  [FALLOCATE]\033[31m Is a directory.\033[0m\n");
+        return NORMAL_ERROR;
+    } else if(find == -1){
+        printf("  [FALLOCATE]\033[31m Invalid path \033[0m'%s'\n", argv[2]);
+        return NORMAL_ERROR;
+    }
+    int fd = do_open(argv[2], O_WRONLY);
+    if(fd == -1){
+        printf("  [FALLOCATE]\033[31m Failed to open file \033[0m'%s'\n", argv[2]);
+        return NORMAL_ERROR;
+    }
+    int ret = do_fallocate(fd, 0, size);
+    do_close(fd);
+    if(ret == -1){
+        printf("  [FALLOCATE]\033[31m No space left.\033[0m\n");
+        return NORMAL_ERROR;
+    } else if(ret != 1){
+        printf("  [FALLOCATE]\033[31m Failed to allocate \033[0m'%s'\n", argv[2]);
+        return NORMAL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+static double percent(uint64_t part, uint64_t total){
+    return total == 0 ? 0 : part * 100.0 / total;
+}
+
+static void cachestat_print(cache_stat_t* c, io_stat_t* d){
+    int policy = get_cache_policy();
+    printf("  Cache: %lu MB, %s, %s\n", get_cache_size() >> 20,
+        (policy & CACHE_REPLACE_ARC) ? "arc" : "lru", (policy & CACHE_WRITE_THROUGH) ? "write-through" : "write-back");
+    printf(" - Lookups: %lu ; Hits: %lu (%.1f%%) ; Misses: %lu\n", c->lookups, c->hits, percent(c->hits, c->lookups), c->misses);
+    printf(" - Metadata lookups: %lu ; Hits: %lu (%.1f%%)\n", c->meta_lookups, c->meta_hits, percent(c->meta_hits, c->meta_lookups));
+    printf(" - Evictions: %lu\n", c->evictions);
+    printf(" - Read ahead: %lu blocks ; Used: %lu (%.1f%%)\n", c->readaheads, c->readahead_hits, percent(c->readahead_hits, c->readaheads));
+    printf(" - Dirty: %lu blocks ; Written back: %lu blocks (%lu sectors)\n", c->dirty_blocks, c->writebacks, c->writeback_sectors);
+    printf(" - Flushes: %lu ; Avg: %.2f ms ; Max: %.2f ms\n", c->flushes,
+        c->flushes == 0 ? 0 : c->flush_ns / 1e6 / c->flushes, c->flush_max_ns / 1e6);
+    if(get_ztier_size() > 0){
+        ztier_stat_t z;
+        ztier_get_stat(&z);
+        printf("  Compressed tier: %lu MB\n", get_ztier_size() >> 20);
+        printf(" - Holding: %lu blocks in %.1f MB ; Ratio: %.2fx\n", z.entries, z.used_bytes / 1048576.0,
+            z.stored_bytes == 0 ? 0 : (double)z.stores * CACHE_BLOCK_SIZE / z.stored_bytes);
+        printf(" - Lookups: %lu ; Hits: %lu (%.1f%%) ; Overwritten: %lu\n", z.lookups, z.hits, percent(z.hits, z.lookups), z.evictions);
+    }
+    printf("  Device:\n");
+    printf(" - Read: %lu ops, %.1f MB\n", d->read_ops, d->read_bytes / 1048576.0);
+    printf(" - Write: %lu ops, %.1f MB\n", d->write_ops, d->write_bytes / 1048576.0);
+}
+
+static wrong_tag_t run_cachestat(int argc, char** argv){
+    int reset = 0, interval = 0, count = 10;
+    int i = 1;
+    if(i < argc && strcmp(argv[i], "-r") == 0){
+        reset = 1;
+        i++;
+    }
+    if(i < argc)
+        interval = atoi(argv[i++]);
+    if(i < argc)
+        count = atoi(argv[i++]);
+    if(i < argc || (argc > 1 + reset && (interval <= 0 || count <= 0))){
+        printf("  [CACHESTAT]\033[31m Invalid arguments.\033[0m\n");
+        printf("      Usage: cachestat [-r] [Interval [Count]]\n");
+        printf("  Options:\n");
+        printf("      -r: Reset the counters after printing them.\n");
+        printf("      Interval: Print what changed every Interval seconds, Count times (default: 10).\n");
+        return NORMAL_ERROR;
+    }
+    cache_stat_t c, last_c;
+    io_stat_t d, last_d;
+    cache_get_stat(&c);
+    io_get_stat(&d);
+    if(interval == 0){
+        cachestat_print(&c, &d);
+    } else {
+        // the flusher and readahead keep going in the background, so there is something to see
+        printf("  %9s %6s %8s %8s %8s %7s %8s %8s %8s %8s %8s %9s\n", "lookups", "hit%", "misses", "evicts", "ra-used",
+            "dirty", "wb-blks", "rd-ops", "rd-MB", "wr-ops", "wr-MB", "flush-ms");
+        for(int n = 0; n < count; n++){
+            last_c = c;
+            last_d = d;
+            sleep(interval);
+            cache_get_stat(&c);
+            io_get_stat(&d);
+            uint64_t lookups = c.lookups - last_c.lookups, flushes = c.flushes - last_c.flushes;
+            printf("  %9lu %6.1f %8lu %8lu %8lu %7lu %8lu %8lu %8.1f %8lu %8.1f %9.2f\n", lookups,
+                percent(c.hits - last_c.hits, lookups), c.misses - last_c.misses, c.evictions - last_c.evictions,
+                c.readahead_hits - last_c.readahead_hits, c.dirty_blocks, c.writebacks - last_c.writebacks,
+                d.read_ops - last_d.read_ops, (d.read_bytes - last_d.read_bytes) / 1048576.0,
+                d.write_ops - last_d.write_ops, (d.write_bytes - last_d.write_bytes) / 1048576.0,
+                flushes == 0 ? 0 : (c.flush_ns - last_c.flush_ns) / 1e6 / flushes);
+        }
+    }
+    if(reset){
+        cache_reset_stat();
+        ztier_reset_stat();
+        io_reset_stat();
+    }
+    return NO_ERROR;
+}
+
 static char* _strtok_index = NULL;
 static char* mystrtok(char* str, char delim){
     if(str != NULL)
@@ -492,6 +661,12 @@ static int term_analyze(char *str)
                 wrong_tag += run_echo(one_cmd_argc, argv);
             } else if(strcmp(argv[0], "cat") == 0){
                 wrong_tag += run_cat(one_cmd_argc, argv);
+            } else if(strcmp(argv[0], "truncate") == 0){
+                wrong_tag += run_truncate(one_cmd_argc, argv);
+            } else if(strcmp(argv[0], "fallocate") == 0){
+                wrong_tag += run_fallocate(one_cmd_argc, argv);
+            } else if(strcmp(argv[0], "cachestat") == 0){
+                wrong_tag += run_cachestat(one_cmd_argc, argv);
             } else if(strcmp(argv[0], "quit") == 0){
                 return 114514;
             } else {
@@ -570,16 +745,123 @@ static void term_run()
     }
 }
 
-int main() {
+static void print_usage(char* prog){
+    printf("Usage: %s [options]\n", prog);
+    printf("  Options:\n");
+    printf("      -b [stdio|pread|direct|mmap]: Device backend (default: pread).\n");
+    printf("      -a [uring|threads]: Asynchronous I/O engine (default: uring).\n");
+    printf("      -t [hdd|sata|nvme|LAT_US,SEEK_US,MBPS,QD]: Emulate device latency and bandwidth.\n");
+    printf("      -i [Image]: Image file (default: %s).\n", IMAGE_PATH);
+    printf("      -s [Size]: Device size, e.g. 512M or 20G (default: size of the image).\n");
+    printf("      -r [lru|arc]: Block cache replacement policy (default: lru).\n");
+    printf("      -c [Size]: Block cache size, e.g. 128M or 4G (default: 128M).\n");
+    printf("      -z [Size]: Compressed tier for evicted blocks, e.g. 64M (default: off).\n");
+    printf("      -d: Delayed allocation, blocks get their place on the device when written back.\n");
+}
+
+static int parse_args(int argc, char** argv){
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-b") == 0 && i + 1 < argc){
+            int backend = 0;
+            while(io_backend_name(backend) != NULL && strcmp(io_backend_name(backend), argv[i+1]) != 0)
+                backend++;
+            if(io_backend_name(backend) == NULL){
+                printf("  \033[31mUnknown backend\033[0m '%s'\n", argv[i+1]);
+                return 0;
+            }
+            change_io_backend(backend);
+            i++;
+        } else if(strcmp(argv[i], "-a") == 0 && i + 1 < argc){
+            if(strcmp(argv[i+1], "uring") == 0)
+                change_aio_engine(AIO_ENGINE_URING);
+            else if(strcmp(argv[i+1], "threads") == 0)
+                change_aio_engine(AIO_ENGINE_THREADS);
+            else{
+                printf("  \033[31mUnknown aio engine\033[0m '%s'\n", argv[i+1]);
+                return 0;
+            }
+            i++;
+        } else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc){
+            unsigned latency_us, seek_us, bandwidth_mb, queue_depth;
+            int profile = 0;
+            while(io_throttle_name(profile) != NULL && strcmp(io_throttle_name(profile), argv[i+1]) != 0)
+                profile++;
+            if(io_throttle_name(profile) != NULL)
+                change_io_throttle(profile);
+            else if(sscanf(argv[i+1], "%u,%u,%u,%u", &latency_us, &seek_us, &bandwidth_mb, &queue_depth) == 4)
+                change_io_throttle_params(latency_us, seek_us, bandwidth_mb, queue_depth);
+            else{
+                printf("  \033[31mUnknown device profile\033[0m '%s'\n", argv[i+1]);
+                return 0;
+            }
+            i++;
+        } else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc){
+            change_image_path(argv[i+1]);
+            i++;
+        } else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+            uint64_t size = parse_size(argv[i+1]);
+            if(size == 0){
+                printf("  \033[31mInvalid size\033[0m '%s'\n", argv[i+1]);
+                return 0;
+            }
+            change_image_size(size);
+            i++;
+        } else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc){
+            int write_mode = get_cache_policy() & CACHE_WRITE_MASK;
+            if(strcmp(argv[i+1], "lru") == 0)
+                change_cache_policy(write_mode | CACHE_REPLACE_LRU);
+            else if(strcmp(argv[i+1], "arc") == 0)
+                change_cache_policy(write_mode | CACHE_REPLACE_ARC);
+            else{
+                printf("  \033[31mUnknown replacement policy\033[0m '%s'\n", argv[i+1]);
+                return 0;
+            }
+            i++;
+        } else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+            uint64_t size = parse_size(argv[i+1]);
+            if(size == 0){
+                printf("  \033[31mInvalid size\033[0m '%s'\n", argv[i+1]);
+                return 0;
+            }
+            change_cache_size(size);
+            i++;
+        } else if(strcmp(argv[i], "-z") == 0 && i + 1 < argc){
+            uint64_t size = parse_size(argv[i+1]);
+            if(size == 0){
+                printf("  \033[31mInvalid size\033[0m '%s'\n", argv[i+1]);
+                return 0;
+            }
+            change_ztier_size(size);
+            i++;
+        } else if(strcmp(argv[i], "-d") == 0){
+            change_delalloc(1);
+        } else {
+            print_usage(argv[0]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if(!parse_args(argc, argv))
+        return 1;
     printf("\n------------------------Welcome to GRFS!-----------------------------\n");
     init_io();
     init_fs();
-    do_mkfs();
+    if(do_mkfs() == -1){
+        printf("  \033[31mThe image holds a grfs file system of an older layout (without block groups), it is not mounted.\033[0m\n");
+        printf("  \033[31mCopy its files out with an older grfs, or remove the image to create a new one.\033[0m\n");
+        release_fs();
+        release_io();
+        return 1;
+    }
     do_statfs();
     // term_run();
     // int fd = do_open("test.txt", O_RDWR);
     // do_lseek(fd, 134217728 - 1, SEEK_SET);
     // do_write(fd, "\0", 1);
     term_run();
+    release_fs();
     release_io();
 }
\ No newline at end of file
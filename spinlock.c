@@ -1,16 +1,25 @@
 #include "spinlock.h"
 #include <stdio.h>
+#include <sched.h>
+
+// its address tells the threads apart
+static __thread char this_thread;
 
 void spinlock_init(spinlock_t *lock) {
     lock->locked = 0;
+    lock->owner = NULL;
 }
 
 void acquire(spinlock_t *lock) {
-    if(lock->locked) {
+    if(__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) == &this_thread) {
         printf("spinlock is already locked\n");
         while(1);
     }
-    lock->locked = 1;
+    // other threads (the cache flusher) take it too, wait for them to give it back
+    while(__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+        while(__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+            sched_yield();
+    __atomic_store_n(&lock->owner, &this_thread, __ATOMIC_RELAXED);
 }
 
 void release(spinlock_t *lock) {
@@ -18,5 +27,6 @@ void release(spinlock_t *lock) {
         printf("spinlock is not locked\n");
         while(1);
     }
-    lock->locked = 0;
-}
\ No newline at end of file
+    __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
@@ -3,10 +3,11 @@
 
 typedef struct spinlock {
     int locked;
+    void *owner; // the thread holding it, taking it again from there is a deadlock
 } spinlock_t;
 
 void spinlock_init(spinlock_t *lock);
 void acquire(spinlock_t *lock);
 void release(spinlock_t *lock);
 
-#endif /* SPINLOCK_H */
\ No newline at end of file
+#endif /* SPINLOCK_H */
@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include "io.h"
+
+typedef struct io_throttle {
+    const char* name;
+    unsigned latency_us;   // paid by every request
+    unsigned seek_us;      // extra when a request does not start where the last one ended
+    unsigned bandwidth_mb; // MB/s shared by all requests
+    unsigned queue_depth;  // requests the device works on at once
+} io_throttle_t;
+
+static io_throttle_t io_throttles[] = {
+    [IO_THROTTLE_NONE] = {"none", 0, 0, 0, 0},
+    [IO_THROTTLE_HDD] = {"hdd", 100, 8000, 160, 1},
+    [IO_THROTTLE_SATA] = {"sata", 80, 0, 520, 32},
+    [IO_THROTTLE_NVME] = {"nvme", 15, 0, 3000, 128},
+    [IO_THROTTLE_CUSTOM] = {"custom", 0, 0, 0, 1},
+};
+
+#define IO_THROTTLE_NUM (int)(sizeof(io_throttles) / sizeof(io_throttles[0]))
+
+static io_throttle_t* throttle = &io_throttles[IO_THROTTLE_NONE];
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t throttle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned throttle_inflight = 0;
+static uint64_t throttle_bus_free = 0; // ns, when the emulated device finishes its queued transfers
+static uint64_t throttle_head = 0;     // sector after the last request
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void change_io_throttle(int profile){
+    assert(profile >= 0 && profile < IO_THROTTLE_NUM);
+    throttle = &io_throttles[profile];
+}
+
+void change_io_throttle_params(unsigned latency_us, unsigned seek_us, unsigned bandwidth_mb, unsigned queue_depth){
+    io_throttle_t* custom = &io_throttles[IO_THROTTLE_CUSTOM];
+    custom->latency_us = latency_us;
+    custom->seek_us = seek_us;
+    custom->bandwidth_mb = bandwidth_mb;
+    custom->queue_depth = queue_depth ? queue_depth : 1;
+    throttle = custom;
+}
+
+int get_io_throttle_queue_depth(){
+    return throttle == &io_throttles[IO_THROTTLE_NONE] ? 0 : throttle->queue_depth;
+}
+
+const char* io_throttle_name(int profile){
+    if(profile < 0 || profile >= IO_THROTTLE_NUM)
+        return NULL;
+    return io_throttles[profile].name;
+}
+
+void io_throttle(uint64_t start_sector_id, size_t size){
+    if(throttle == &io_throttles[IO_THROTTLE_NONE])
+        return;
+    pthread_mutex_lock(&throttle_lock);
+    while(throttle_inflight >= throttle->queue_depth)
+        pthread_cond_wait(&throttle_cond, &throttle_lock);
+    throttle_inflight++;
+
+    uint64_t now = now_ns();
+    uint64_t latency = (uint64_t)throttle->latency_us * 1000;
+    if(start_sector_id != throttle_head)
+        latency += (uint64_t)throttle->seek_us * 1000;
+    throttle_head = start_sector_id + size / 512;
+    // the transfer starts once the request is served and the bus is free
+    uint64_t begin = now + latency;
+    if(begin < throttle_bus_free)
+        begin = throttle_bus_free;
+    if(throttle->bandwidth_mb)
+        throttle_bus_free = begin + size * 1000 / throttle->bandwidth_mb;
+    else
+        throttle_bus_free = begin;
+    uint64_t done = throttle_bus_free;
+    pthread_mutex_unlock(&throttle_lock);
+
+    struct timespec ts = {done / 1000000000, done % 1000000000};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+
+    pthread_mutex_lock(&throttle_lock);
+    throttle_inflight--;
+    pthread_cond_signal(&throttle_cond);
+    pthread_mutex_unlock(&throttle_lock);
+}
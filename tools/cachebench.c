@@ -0,0 +1,134 @@
+#include "../grfs.h"
+#include "../io.h"
+#include "../cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// metadata hit rate of the block cache while a file larger than the cache is read sequentially
+
+#define BENCH_IMAGE "bench.img"
+#define BENCH_FILE_MB 256 // twice the cache
+#define BENCH_DIRS 8
+#define BENCH_FILES 8
+#define BENCH_ROUNDS 4
+#define BENCH_CHUNK (64 * 1024)
+
+int now_ino;
+
+static char buf[BENCH_CHUNK];
+
+static void mount(){
+    init_io();
+    init_fs();
+    do_mkfs();
+}
+
+static void setup(int file_mb){
+    mount();
+    for(int d = 0; d < BENCH_DIRS; d++){
+        char path[32];
+        sprintf(path, "d%d", d);
+        do_mkdir(path);
+        for(int f = 0; f < BENCH_FILES; f++){
+            sprintf(path, "d%d/f%d", d, f);
+            fd_t fd = do_open(path, O_RDWR);
+            do_write(fd, path, strlen(path));
+            do_close(fd);
+        }
+    }
+    fd_t fd = do_open("big", O_RDWR);
+    memset(buf, 'x', sizeof(buf));
+    for(long i = 0; i < (long)file_mb * 1024 * 1024 / BENCH_CHUNK; i++)
+        do_write(fd, buf, BENCH_CHUNK);
+    do_close(fd);
+    release_fs();
+    release_io();
+}
+
+// path lookups, small reads and an allocate/free: inode table, bitmaps and directories
+static void meta_pass(){
+    char path[32];
+    for(int d = 0; d < BENCH_DIRS; d++){
+        for(int f = 0; f < BENCH_FILES; f++){
+            sprintf(path, "d%d/f%d", d, f);
+            do_find(path);
+            fd_t fd = do_open(path, O_RDONLY);
+            do_read(fd, buf, 32);
+            do_close(fd);
+        }
+        sprintf(path, "d%d/tmp", d);
+        fd_t fd = do_open(path, O_RDWR);
+        do_write(fd, path, strlen(path));
+        do_close(fd);
+        do_rm(path);
+    }
+}
+
+static void scan(){
+    fd_t fd = do_open("big", O_RDONLY);
+    while(do_read(fd, buf, BENCH_CHUNK) > 0)
+        ;
+    do_close(fd);
+}
+
+static void run(int policy, const char* name){
+    change_cache_policy(CACHE_WRITE_BACK | policy);
+    mount();
+    // touched twice before measuring, as the working set of a running system would be
+    meta_pass();
+    meta_pass();
+
+    cache_stat_t meta = {0}, stat;
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for(int round = 0; round < BENCH_ROUNDS; round++){
+        scan();
+        cache_reset_stat();
+        meta_pass();
+        cache_get_stat(&stat);
+        meta.meta_lookups += stat.meta_lookups;
+        meta.meta_hits += stat.meta_hits;
+        meta.lookups += stat.lookups;
+        meta.hits += stat.hits;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf("%-6s %10.1f%% %11llu %10.1f%% %9.2fs\n", name,
+        100.0 * meta.meta_hits / meta.meta_lookups, (unsigned long long)(meta.meta_lookups - meta.meta_hits),
+        100.0 * meta.hits / meta.lookups, seconds);
+    release_fs();
+    release_io();
+}
+
+// every phase runs in its own process so each policy starts from a cold cache
+static void fork_run(int policy, const char* name, int file_mb){
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0){
+        if(name == NULL)
+            setup(file_mb);
+        else
+            run(policy, name);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// usage: cachebench [image] [file MB], the image must be larger than the file
+int main(int argc, char** argv){
+    char* path = argc > 1 ? argv[1] : BENCH_IMAGE;
+    int file_mb = argc > 2 ? atoi(argv[2]) : BENCH_FILE_MB;
+    change_image_path(path);
+    // every policy starts from a cold cache
+    change_cache_warmup(0);
+    printf("%d MB sequential read between metadata passes, %d MB cache\n", file_mb, (int)(get_cache_size() >> 20));
+    fork_run(0, NULL, file_mb);
+    printf("policy   meta hit  meta misses    all hit       time\n");
+    fork_run(CACHE_REPLACE_LRU, "lru", file_mb);
+    fork_run(CACHE_REPLACE_ARC, "arc", file_mb);
+    return 0;
+}
@@ -1,16 +1,38 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #define IMAGE_SIZE 512*1024*1024 // 512MB
 
-#define MAX_SECTORS (IMAGE_SIZE/512)
-
 #define IMAGE_PATH "image"
 
 FILE *img;
 
-void main(){
-    img = fopen(IMAGE_PATH, "w+");
-    fseek(img, IMAGE_SIZE-1, SEEK_SET);
+// "512M", "20G", ... to bytes, 0 if invalid
+static long parse_size(char* str){
+    char* end;
+    long size = strtol(str, &end, 10);
+    switch(*end){
+        case 'T': case 't': size <<= 10; // fall through
+        case 'G': case 'g': size <<= 10; // fall through
+        case 'M': case 'm': size <<= 10; // fall through
+        case 'K': case 'k': size <<= 10; end++;
+    }
+    if(*end == 'B' || *end == 'b')
+        end++;
+    return *end == '\0' ? size : 0;
+}
+
+// usage: createimage [path] [size]
+int main(int argc, char** argv){
+    char* path = argc > 1 ? argv[1] : IMAGE_PATH;
+    long size = argc > 2 ? parse_size(argv[2]) : IMAGE_SIZE;
+    if(size <= 0){
+        printf("Invalid size '%s'\n", argv[2]);
+        return 1;
+    }
+    img = fopen(path, "w+");
+    fseek(img, size-1, SEEK_SET);
     fputc(0, img);
     fclose(img);
-}
\ No newline at end of file
+    return 0;
+}
@@ -6,6 +6,8 @@ typedef unsigned short uint16_t;
 typedef unsigned int uint32_t;
 typedef unsigned long uint64_t;
 
+#ifndef NULL
 #define NULL (void *)0
+#endif
 
 #endif /* TYPE_H */
\ No newline at end of file
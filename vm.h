@@ -7,7 +7,8 @@
 #define PA2KVA(pa) ((unsigned long)(pa))
 
 static inline void* allocPage(){
-    return (void*)malloc(BLOCK_SIZE);
+    // page aligned so that O_DIRECT transfers need no bounce buffer
+    return (void*)aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
 }
 
 #endif /* VM_H */
\ No newline at end of file
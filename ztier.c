@@ -0,0 +1,337 @@
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "cache.h"
+
+// second cache tier: clean blocks evicted from the cache, compressed into a circular log.
+// A block lives in at most one of the tiers, ztier_load takes it out of this one
+
+typedef struct {
+    uint64_t block_id;
+    uint32_t offset; // in the log
+    uint16_t len;    // ZTIER_RAW for a block that did not compress
+    uint16_t valid;  // cleared by ztier_load and ztier_invalidate, the space is reclaimed on wrap
+} zt_entry_t;
+
+static uint64_t zt_size = 0;
+static uint8_t* zt_log = NULL;
+static uint64_t zt_head = 0; // where the next block is appended
+
+// the entries in log order, oldest at zt_tail
+static zt_entry_t* zt_entries = NULL;
+static uint32_t zt_entry_cap = 0;
+static uint32_t zt_tail = 0, zt_num = 0;
+
+// block number -> entry, open addressing like the cache table
+static int* zt_hash = NULL;
+static uint32_t zt_hash_mask = 0;
+
+static void* zt_arena = NULL;
+static size_t zt_arena_size = 0;
+
+static ztier_stat_t zt_stat;
+
+static pthread_mutex_t zt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* LZ4 block format: a token with 4 bits of literal length and 4 bits of match length - 4,
+ * the literals, a 2 byte offset, longer lengths continued in bytes of 255. The last 5 bytes
+ * are always literals and no match starts in the last 12 */
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MFLIMIT 12
+#define LZ_LAST_LITERALS 5
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_write_len(uint8_t* op, int len) {
+    while(len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// returns the compressed length, 0 if it does not fit in cap
+static int lz_compress(const uint8_t* src, int n, uint8_t* dst, int cap) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    assert(n < 65536);
+    memset(table, 0, sizeof(table));
+    if(n > LZ_MFLIMIT) {
+        const uint8_t* mflimit = end - LZ_MFLIMIT;
+        const uint8_t* matchlimit = end - LZ_LAST_LITERALS;
+        while(ip < mflimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t* ref = src + table[h];
+            table[h] = ip - src;
+            if(ref >= ip || lz_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+            while(m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+            int lit = ip - anchor, mlen = m - ip - LZ_MIN_MATCH;
+            if(op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend)
+                return 0;
+            uint8_t* token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+            if(lit >= 15)
+                op = lz_write_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            if(mlen >= 15)
+                op = lz_write_len(op, mlen - 15);
+            anchor = ip = m;
+        }
+    }
+    int lit = end - anchor;
+    if(op + 1 + lit + lit / 255 + 1 > oend)
+        return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if(lit >= 15)
+        op = lz_write_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static const uint8_t* lz_read_len(const uint8_t* ip, const uint8_t* iend, int* len) {
+    int b;
+    do {
+        if(ip >= iend)
+            return NULL;
+        b = *ip++;
+        *len += b;
+    } while(b == 255);
+    return ip;
+}
+
+// returns the decompressed length, -1 if src is corrupt or does not fit in cap
+static int lz_decompress(const uint8_t* src, int n, uint8_t* dst, int cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while(ip < iend) {
+        int token = *ip++;
+        int lit = token >> 4;
+        if(lit == 15 && (ip = lz_read_len(ip, iend, &lit)) == NULL)
+            return -1;
+        if(lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if(ip == iend)
+            break;
+        if(iend - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if(mlen == 15 && (ip = lz_read_len(ip, iend, &mlen)) == NULL)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if(offset == 0 || offset > op - dst || mlen > oend - op)
+            return -1;
+        // the match may overlap what it produces
+        const uint8_t* r = op - offset;
+        while(mlen--)
+            *op++ = *r++;
+    }
+    return op - dst;
+}
+
+static uint32_t zt_hash_home(uint64_t block_id) {
+    return (uint32_t)((block_id * 0x9E3779B97F4A7C15ULL) >> 32) & zt_hash_mask;
+}
+
+static uint32_t zt_hash_find(uint64_t block_id) {
+    for(uint32_t i = zt_hash_home(block_id); ; i = (i + 1) & zt_hash_mask)
+        if(zt_hash[i] == CACHE_HASH_EMPTY || zt_entries[zt_hash[i]].block_id == block_id)
+            return i;
+}
+
+static void zt_hash_remove(uint64_t block_id) {
+    uint32_t hole = zt_hash_find(block_id);
+    assert(zt_hash[hole] != CACHE_HASH_EMPTY);
+    // backward shift deletion, see cache_hash_remove
+    for(uint32_t i = (hole + 1) & zt_hash_mask; zt_hash[i] != CACHE_HASH_EMPTY; i = (i + 1) & zt_hash_mask) {
+        uint32_t home = zt_hash_home(zt_entries[zt_hash[i]].block_id);
+        if(((i - home) & zt_hash_mask) >= ((i - hole) & zt_hash_mask)) {
+            zt_hash[hole] = zt_hash[i];
+            hole = i;
+        }
+    }
+    zt_hash[hole] = CACHE_HASH_EMPTY;
+}
+
+// already hold the zt_lock
+static void zt_drop(zt_entry_t* entry) {
+    if(!entry->valid)
+        return;
+    zt_hash_remove(entry->block_id);
+    entry->valid = 0;
+    zt_stat.entries--;
+    zt_stat.used_bytes -= entry->len;
+}
+
+// already hold the zt_lock
+// give up the oldest entry of the log
+static void zt_pop() {
+    zt_entry_t* entry = &zt_entries[zt_tail];
+    if(entry->valid)
+        zt_stat.evictions++;
+    zt_drop(entry);
+    zt_tail = (zt_tail + 1) % zt_entry_cap;
+    zt_num--;
+}
+
+void change_ztier_size(uint64_t size) {
+    zt_size = size;
+}
+
+uint64_t get_ztier_size() {
+    return zt_size;
+}
+
+void ztier_init() {
+    if(zt_size == 0 || zt_arena != NULL)
+        return;
+    zt_entry_cap = zt_size / ZTIER_MIN_ENTRY;
+    uint32_t hash_size = 1;
+    while(hash_size < 2 * zt_entry_cap)
+        hash_size <<= 1;
+    zt_arena_size = zt_size + zt_entry_cap * sizeof(zt_entry_t) + hash_size * sizeof(int);
+    zt_arena = mmap(NULL, zt_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(zt_arena == MAP_FAILED) {
+        zt_arena = NULL;
+        return;
+    }
+    zt_log = zt_arena;
+    zt_entries = (zt_entry_t*)(zt_log + zt_size);
+    zt_hash = (int*)(zt_entries + zt_entry_cap);
+    zt_hash_mask = hash_size - 1;
+    for(uint32_t i = 0; i < hash_size; i++)
+        zt_hash[i] = CACHE_HASH_EMPTY;
+    zt_head = zt_tail = zt_num = 0;
+    memset(&zt_stat, 0, sizeof(zt_stat));
+}
+
+int ztier_enabled() {
+    return zt_arena != NULL;
+}
+
+void ztier_release() {
+    if(zt_arena == NULL)
+        return;
+    munmap(zt_arena, zt_arena_size);
+    zt_arena = NULL;
+}
+
+void ztier_store(uint64_t block_id, const void* data) {
+    if(zt_arena == NULL)
+        return;
+    uint8_t buf[CACHE_BLOCK_SIZE];
+    // compressed before taking the lock, a block saving less than ZTIER_MIN_GAIN is kept raw
+    int len = lz_compress(data, CACHE_BLOCK_SIZE, buf, CACHE_BLOCK_SIZE - ZTIER_MIN_GAIN);
+    const uint8_t* src = buf;
+    if(len == 0) {
+        len = ZTIER_RAW;
+        src = data;
+    }
+    pthread_mutex_lock(&zt_lock);
+    uint32_t i = zt_hash_find(block_id);
+    if(zt_hash[i] != CACHE_HASH_EMPTY)
+        zt_drop(&zt_entries[zt_hash[i]]);
+    if(zt_head + len > zt_size) {
+        // the entries behind the head are the oldest ones, and the end of the log is too short
+        while(zt_num > 0 && zt_entries[zt_tail].offset >= zt_head)
+            zt_pop();
+        zt_head = 0;
+    }
+    while(zt_num > 0 && (zt_num == zt_entry_cap
+        || (zt_entries[zt_tail].offset >= zt_head && zt_entries[zt_tail].offset < zt_head + len)))
+        zt_pop();
+    zt_entry_t* entry = &zt_entries[(zt_tail + zt_num) % zt_entry_cap];
+    zt_num++;
+    entry->block_id = block_id;
+    entry->offset = zt_head;
+    entry->len = len;
+    entry->valid = 1;
+    memcpy(zt_log + zt_head, src, len);
+    zt_head += len;
+    zt_hash[zt_hash_find(block_id)] = entry - zt_entries;
+    zt_stat.stores++;
+    zt_stat.stored_bytes += len;
+    zt_stat.entries++;
+    zt_stat.used_bytes += len;
+    pthread_mutex_unlock(&zt_lock);
+}
+
+int ztier_load(uint64_t block_id, void* data) {
+    if(zt_arena == NULL)
+        return 0;
+    int hit = 0;
+    pthread_mutex_lock(&zt_lock);
+    zt_stat.lookups++;
+    int index = zt_hash[zt_hash_find(block_id)];
+    if(index != CACHE_HASH_EMPTY) {
+        zt_entry_t* entry = &zt_entries[index];
+        if(entry->len == ZTIER_RAW) {
+            memcpy(data, zt_log + entry->offset, CACHE_BLOCK_SIZE);
+        } else {
+            int len = lz_decompress(zt_log + entry->offset, entry->len, data, CACHE_BLOCK_SIZE);
+            assert(len == CACHE_BLOCK_SIZE);
+        }
+        zt_drop(entry);
+        zt_stat.hits++;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&zt_lock);
+    return hit;
+}
+
+void ztier_invalidate(uint64_t block_id) {
+    if(zt_arena == NULL)
+        return;
+    pthread_mutex_lock(&zt_lock);
+    int index = zt_hash[zt_hash_find(block_id)];
+    if(index != CACHE_HASH_EMPTY)
+        zt_drop(&zt_entries[index]);
+    pthread_mutex_unlock(&zt_lock);
+}
+
+void ztier_get_stat(ztier_stat_t* stat) {
+    pthread_mutex_lock(&zt_lock);
+    *stat = zt_stat;
+    pthread_mutex_unlock(&zt_lock);
+}
+
+void ztier_reset_stat() {
+    pthread_mutex_lock(&zt_lock);
+    // entries and used_bytes describe the contents, not events
+    zt_stat.stores = zt_stat.stored_bytes = 0;
+    zt_stat.lookups = zt_stat.hits = zt_stat.evictions = 0;
+    pthread_mutex_unlock(&zt_lock);
+}